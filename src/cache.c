@@ -0,0 +1,345 @@
+#include "cache.h"
+#include "util.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#define CACHE_SHARDS 16
+#define CACHE_MIN_BUCKETS 64
+
+// Frequency sketch used for admission, 4 rows of 4-bit saturating counters
+// (stored in bytes). Counters are halved every CACHE_SKETCH_SAMPLES lookups,
+// so that the frequencies follow what is popular now.
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_WIDTH 1024
+#define CACHE_SKETCH_MAX 15
+#define CACHE_SKETCH_SAMPLES (10 * CACHE_SKETCH_WIDTH)
+
+struct cache_shard
+{
+    _Alignas(64) pthread_mutex_t lock;
+
+    // Chained hash table
+    struct cache_entry **buckets;
+    size_t num_buckets;
+    size_t num_entries;
+
+    // All entries, in CLOCK order. The hand points at the next eviction candidate.
+    struct list clock;
+    struct list *hand;
+
+    size_t bytes;
+    size_t capacity;
+
+    uint8_t sketch[CACHE_SKETCH_ROWS][CACHE_SKETCH_WIDTH];
+    uint32_t samples;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct cache
+{
+    struct cache_shard shards[CACHE_SHARDS];
+};
+
+static inline uint64_t hash_key(uint64_t key)
+{
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+static inline size_t entry_size(const struct cache_entry *entry)
+{
+    return sizeof *entry + entry->len;
+}
+
+static inline bool is_expired(const struct cache_entry *entry)
+{
+    return entry->expires && entry->expires <= get_time() / 1000000000ULL;
+}
+
+static inline size_t sketch_index(uint64_t hash, int row)
+{
+    uint64_t step = (hash >> 32) | 1;
+    return (size_t)((hash + (uint64_t)row * step) & (CACHE_SKETCH_WIDTH - 1));
+}
+
+static void sketch_add(struct cache_shard *shard, uint64_t hash)
+{
+    for (int i = 0; i < CACHE_SKETCH_ROWS; i++) {
+        uint8_t *counter = &shard->sketch[i][sketch_index(hash, i)];
+        if (*counter < CACHE_SKETCH_MAX)
+            (*counter)++;
+    }
+
+    if (++shard->samples >= CACHE_SKETCH_SAMPLES) {
+        for (int i = 0; i < CACHE_SKETCH_ROWS; i++) {
+            for (size_t j = 0; j < CACHE_SKETCH_WIDTH; j++)
+                shard->sketch[i][j] >>= 1;
+        }
+        shard->samples /= 2;
+    }
+}
+
+static uint8_t sketch_estimate(const struct cache_shard *shard, uint64_t hash)
+{
+    uint8_t min = CACHE_SKETCH_MAX;
+    for (int i = 0; i < CACHE_SKETCH_ROWS; i++) {
+        uint8_t counter = shard->sketch[i][sketch_index(hash, i)];
+        if (counter < min)
+            min = counter;
+    }
+    return min;
+}
+
+static inline struct cache_entry **find_slot(struct cache_shard *shard, uint64_t hash, uint64_t key)
+{
+    struct cache_entry **slot = &shard->buckets[hash & (shard->num_buckets - 1)];
+    while (*slot && (*slot)->key != key)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+static void grow_buckets(struct cache_shard *shard)
+{
+    size_t num_buckets = shard->num_buckets * 2;
+    struct cache_entry **buckets = calloc(num_buckets, sizeof *buckets);
+    if (!buckets)
+        return; // Chains just get longer
+
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        struct cache_entry *entry = shard->buckets[i];
+        while (entry) {
+            struct cache_entry *next = entry->next;
+            size_t idx = hash_key(entry->key) & (num_buckets - 1);
+            entry->next = buckets[idx];
+            buckets[idx] = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->num_buckets = num_buckets;
+}
+
+// Advances the hand until it finds an entry that wasn't referenced since the
+// last pass, and returns it. The shard must not be empty.
+static struct cache_entry *clock_victim(struct cache_shard *shard)
+{
+    while (1) {
+        if (shard->hand == &shard->clock)
+            shard->hand = shard->clock.next;
+        struct cache_entry *entry = list_entry(shard->hand, struct cache_entry, clock);
+        if (!entry->referenced)
+            return entry;
+        entry->referenced = false;
+        shard->hand = shard->hand->next;
+    }
+}
+
+static void remove_entry(struct cache_shard *shard, struct cache_entry *entry)
+{
+    struct cache_entry **slot = find_slot(shard, hash_key(entry->key), entry->key);
+    *slot = entry->next;
+    if (shard->hand == &entry->clock)
+        shard->hand = entry->clock.next;
+    list_del_entry(entry, clock);
+    shard->num_entries--;
+    shard->bytes -= entry_size(entry);
+    cache_release(entry);
+}
+
+struct cache *create_cache(size_t capacity)
+{
+    struct cache *cache = aligned_alloc(_Alignof(struct cache), sizeof *cache);
+    if (!cache) return NULL;
+    zero_structp(cache);
+
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        if (pthread_mutex_init(&shard->lock, NULL))
+            goto error;
+        LIST_INIT_HEAD(shard->clock);
+        shard->hand = &shard->clock;
+        shard->capacity = capacity / CACHE_SHARDS;
+        shard->num_buckets = CACHE_MIN_BUCKETS;
+        shard->buckets = calloc(shard->num_buckets, sizeof *shard->buckets);
+        if (!shard->buckets) {
+            pthread_mutex_destroy(&shard->lock);
+            goto error;
+        }
+    }
+    return cache;
+
+error:
+    while (i--) {
+        pthread_mutex_destroy(&cache->shards[i].lock);
+        free(cache->shards[i].buckets);
+    }
+    free(cache);
+    return NULL;
+}
+
+void destroy_cache(struct cache *cache)
+{
+    if (!cache) return;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        struct list *iter, *next;
+        list_for_each_safe(iter, next, &shard->clock) {
+            struct cache_entry *entry = list_entry(iter, struct cache_entry, clock);
+            cache_release(entry);
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+struct cache_entry *cache_get(struct cache *cache, uint64_t key)
+{
+    uint64_t hash = hash_key(key);
+    struct cache_shard *shard = &cache->shards[hash >> 60];
+
+    pthread_mutex_lock(&shard->lock);
+    sketch_add(shard, hash);
+    struct cache_entry *entry = *find_slot(shard, hash, key);
+    if (entry && is_expired(entry)) {
+        remove_entry(shard, entry);
+        entry = NULL;
+    }
+    if (entry) {
+        entry->referenced = true;
+        atomic_fetch_add_explicit(&entry->refs, 1, memory_order_relaxed);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+static inline size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+static struct cache_entry *new_entry(uint64_t key, const struct iovec *iov, int iovcnt, size_t len,
+                                     uint64_t expires, uint32_t refs)
+{
+    struct cache_entry *entry = malloc(sizeof *entry + len);
+    if (!entry)
+        return NULL;
+    entry->key = key;
+    entry->len = (uint32_t)len;
+    entry->expires = expires;
+    entry->referenced = false;
+    char *dst = entry->data;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len); // NOLINT [C11 Annex K]
+        dst += iov[i].iov_len;
+    }
+    atomic_init(&entry->refs, refs);
+    return entry;
+}
+
+struct cache_entry *cache_put(struct cache *cache, uint64_t key, const struct iovec *iov, int iovcnt,
+                              uint64_t expires)
+{
+    uint64_t hash = hash_key(key);
+    struct cache_shard *shard = &cache->shards[hash >> 60];
+    size_t len = iov_length(iov, iovcnt);
+    size_t size = sizeof(struct cache_entry) + len;
+    if (len > UINT32_MAX || size > shard->capacity)
+        return NULL;
+
+    // Copy outside of the lock, so that lookups in the shard don't wait for
+    // it. One reference held by the cache, one by the caller.
+    struct cache_entry *entry = new_entry(key, iov, iovcnt, len, expires, 2);
+    if (!entry)
+        return NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    struct cache_entry **slot = find_slot(shard, hash, key);
+    if (*slot && is_expired(*slot)) {
+        remove_entry(shard, *slot);
+        slot = find_slot(shard, hash, key);
+    }
+    if (*slot) {
+        // Someone else got here first, hand out theirs instead
+        struct cache_entry *existing = *slot;
+        atomic_fetch_add_explicit(&existing->refs, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return existing;
+    }
+
+    if (shard->bytes + size > shard->capacity) {
+        // NOTE: TinyLFU admission. A new value only replaces the CLOCK victim
+        // if it is asked for more often, so that a scan through many values
+        // that are only seen once doesn't flush out the popular ones.
+        struct cache_entry *victim = clock_victim(shard);
+        if (sketch_estimate(shard, hash) <= sketch_estimate(shard, hash_key(victim->key))) {
+            pthread_mutex_unlock(&shard->lock);
+            free(entry);
+            return NULL;
+        }
+        while (shard->bytes + size > shard->capacity) {
+            remove_entry(shard, victim);
+            shard->evictions++;
+            if (shard->bytes + size > shard->capacity)
+                victim = clock_victim(shard);
+        }
+        // The table may have changed under the removals
+        slot = find_slot(shard, hash, key);
+    }
+
+    entry->next = *slot;
+    *slot = entry;
+    _list_add(&entry->clock, shard->hand->prev, shard->hand);
+    shard->num_entries++;
+    shard->bytes += size;
+    if (shard->num_entries > shard->num_buckets)
+        grow_buckets(shard);
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+struct cache_entry *cache_copy(uint64_t key, const struct iovec *iov, int iovcnt, uint64_t expires)
+{
+    size_t len = iov_length(iov, iovcnt);
+    if (len > UINT32_MAX)
+        return NULL;
+    return new_entry(key, iov, iovcnt, len, expires, 1);
+}
+
+void cache_release(struct cache_entry *entry)
+{
+    if (atomic_fetch_sub_explicit(&entry->refs, 1, memory_order_acq_rel) == 1)
+        free(entry);
+}
+
+void cache_stats(struct cache *cache, struct cache_stats *stats)
+{
+    zero_structp(stats);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        struct cache_shard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->num_entries;
+        stats->bytes += shard->bytes;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
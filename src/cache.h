@@ -0,0 +1,56 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "common.h"
+#include "list.h"
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+// In-memory cache of values keyed by a 64-bit key, bounded by the total size
+// of the values. Split into shards with their own locks, so that the workers
+// rarely contend on it.
+
+struct cache;
+
+// NOTE: Entries handed out by the cache are pinned, and stay valid until they
+// are released, even if the cache evicts them meanwhile. The contents are
+// read-only.
+struct cache_entry
+{
+    struct cache_entry *next;
+    struct list clock;
+    uint64_t key;
+    _Atomic uint32_t refs;
+    bool referenced;
+    uint32_t len;
+    // Unix time the entry expires at, zero if it doesn't
+    uint64_t expires;
+    char data[];
+};
+
+struct cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+};
+
+struct cache *create_cache(size_t capacity);
+void destroy_cache(struct cache *cache);
+// Returns the pinned entry for the key, or NULL if it isn't cached or has expired.
+struct cache_entry *cache_get(struct cache *cache, uint64_t key);
+// NOTE: Copies the value, gathered from the iovecs, into the cache and returns
+// it pinned. Returns NULL if the value wasn't admitted, i.e. it is too large,
+// or seen less often than the values it would push out. The entry is dropped
+// once the expiry time (unix time, 0 for never) has passed.
+struct cache_entry *cache_put(struct cache *cache, uint64_t key, const struct iovec *iov, int iovcnt,
+                              uint64_t expires);
+// Copies the value into an entry of its own, outside of any cache, e.g. for a
+// value cache_put didn't take. It is released like the others.
+struct cache_entry *cache_copy(uint64_t key, const struct iovec *iov, int iovcnt, uint64_t expires);
+void cache_release(struct cache_entry *entry);
+void cache_stats(struct cache *cache, struct cache_stats *stats);
+
+#endif
@@ -7,6 +7,7 @@
 #include "cask.h"
 #include "shared.h"
 #include "db.h"
+#include "cache.h"
 #include "buffer.h"
 #include "event.h"
 #include "list.h"
@@ -14,6 +15,7 @@
 #include "route.h"
 #include "worker.h"
 #include "file.h"
+#include "io.h"
 #include "util.h"
 #include <errno.h>
 #include <stdio.h>
@@ -22,21 +24,42 @@
 #include <unistd.h>
 #include <ctype.h>
 
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/select.h>
 
 #define NUM_WORKERS 3
+// Threads doing the database I/O of the workers
+#define NUM_IO_THREADS 4
 #define HOST NULL
 #define PORT "3000"
 
 #define DB_PATH "cask.db"
-#define DB_NUM_BUCKETS 100000
+#define DB_CAPACITY 100000
+// NOTE: Microseconds
+#define DB_COMMIT_WINDOW 200
+// NOTE: Megabytes
+#define CACHE_SIZE 64
+// NOTE: Seconds between compaction passes, and megabytes per second
+#define DB_COMPACT_INTERVAL 60
+#define DB_COMPACT_RATE 16
+// NOTE: Seconds between index snapshots
+#define DB_SNAPSHOT_INTERVAL 300
+// NOTE: Bytes, pastes up to this size are also kept in the index
+#define DB_INLINE_MAX 40
 
 #define IPC_SOCK_PATH "cask.sock"
 
 #define INDEX_PATH "index.html"
 
+// Pastes at least this large are sent with sendfile instead of from the mapping
+#define SENDFILE_THRESHOLD (16*1024)
+
+// Cached responses are keyed by id, followed by the response variant and
+// whether the client takes gzip
+#define RESPONSE_KEY_BITS (RESPONSE_VARIANT_BITS + 1)
+
 static struct cask cask;
 struct cask *g_cask;
 
@@ -95,6 +118,24 @@ static void handle_ipc(void)
             struct ipc_status status;
             status.uptime = uptime;
             status.num_workers = cask.num_workers;
+            struct db_stats stats;
+            db_stats(cask.db, &stats);
+            status.db_count = stats.count;
+            status.db_capacity = stats.capacity;
+            status.db_dedup_hits = stats.dedup_hits;
+            status.db_expired = stats.expired;
+            status.db_reclaimed = stats.reclaimed;
+            struct cache_stats cstats = {0};
+            if (cask.cache)
+                cache_stats(cask.cache, &cstats);
+            status.cache_hits = cstats.hits;
+            status.cache_misses = cstats.misses;
+            status.cache_evictions = cstats.evictions;
+            status.cache_bytes = cstats.bytes;
+            struct rusage usage = {0};
+            getrusage(RUSAGE_SELF, &usage);
+            status.minor_faults = (uint64_t)usage.ru_minflt;
+            status.major_faults = (uint64_t)usage.ru_majflt;
             write(fd, &command, sizeof command);
             write(fd, &status, sizeof status);
 
@@ -105,12 +146,25 @@ static void handle_ipc(void)
                 worker_status.id = worker->id;
                 worker_status.running = worker->running;
                 worker_status.num_conns = worker->num_conns;
+                worker_status.num_requests = worker->num_requests;
+                worker_status.syscalls = event_base_syscalls(worker->base);
                 write(fd, &worker_status, sizeof worker_status);
                 iter = iter->next;
             }
 
             pthread_mutex_unlock(&cask.worker_lock);
         } break;
+
+        case IPC_CMD_RESIZE: {
+            // NOTE: The payload is the new index capacity. Growing the index
+            // doesn't stop the workers, they keep serving meanwhile.
+            uint32_t command = IPC_CMD_RESIZE;
+            int32_t result = db_resize(cask.db, req.payload);
+            if (result != OK)
+                fprintf(stderr, "IPC: Failed to resize the index to %u entries\n", req.payload);
+            write(fd, &command, sizeof command);
+            write(fd, &result, sizeof result);
+        } break;
     }
     close(fd);
 }
@@ -119,13 +173,128 @@ static void index_callback(struct request *req, void *data)
 {
     struct file *file = data;
     if (file->size) {
-        send_response(req, HTTP_STATUS_200, file->data, file->size);
+        send_response_ref(req, HTTP_STATUS_200, file->data, file->size, NULL, NULL);
     } else {
         static const char resp[] = "Index.";
         send_response(req, HTTP_STATUS_200, resp, strlen(resp));
     }
 }
 
+static void release_entry(void *data)
+{
+    cache_release(data);
+}
+
+static struct cache_entry *cache_response(struct request *req, uint64_t key, const void *body, size_t len,
+                                          uint64_t expires)
+{
+    char headers[RESPONSE_HEADERS_MAX];
+    struct iovec iov[2];
+    iov[0].iov_base = headers;
+    iov[0].iov_len = format_headers(req, HTTP_STATUS_200, len, headers);
+    iov[1].iov_base = (void *)(uintptr_t)body;
+    iov[1].iov_len = len;
+    return cache_put(cask.cache, key, iov, 2, expires);
+}
+
+// A request waiting for its paste to be read from the disk
+struct get_op
+{
+    struct io_job job;
+    struct request *req;
+    struct db *db;
+    struct db_view view;
+    uint64_t key;
+    bool cacheable;
+    bool gzip;
+};
+
+// A paste being inserted on the I/O threads
+struct post_op
+{
+    struct io_job job;
+    struct request *req;
+    struct db *db;
+    const char *body;
+    uint32_t len;
+    uint32_t ttl;
+    dbid_t id;
+    int ret;
+};
+
+static void serve_paste(struct request *req, struct db_view *view, uint64_t key, bool cacheable, bool gzip)
+{
+    // Couldn't be read from the disk
+    if (!view->data) {
+        db_release(view->pin);
+        send_response(req, HTTP_STATUS_500, NULL, 0);
+        return;
+    }
+
+    // Compressed pastes are sent as stored or decoded, depending on the
+    // request's Accept-Encoding, so caches on the way have to keep both apart
+    if (view->codec == DB_CODEC_GZIP)
+        set_vary(req, g_http_hkeys[HTTP_HKEY_ACCEPT_ENCODING].s);
+
+    struct cache_entry *entry;
+    if (view->codec == DB_CODEC_NONE || gzip) {
+        // Served as stored
+        if (view->codec == DB_CODEC_GZIP)
+            set_content_encoding(req, "gzip");
+
+        if (view->len >= SENDFILE_THRESHOLD && view->fd >= 0) {
+            // Large pastes are sent straight from the page cache instead
+            send_response_file(req, HTTP_STATUS_200, view->fd, (off_t)view->offset, view->len,
+                               db_release, view->pin);
+            return;
+        }
+
+        entry = cacheable ? cache_response(req, key, view->data, view->len, view->expires) : NULL;
+        if (entry) {
+            db_release(view->pin);
+            send_response_raw(req, entry->data, entry->len, release_entry, entry);
+        } else {
+            send_response_ref(req, HTTP_STATUS_200, view->data, view->len, db_release, view->pin);
+        }
+        return;
+    }
+
+    // NOTE: Stored compressed, but the client doesn't take gzip. Only these
+    // requests pay for decompression, and the cache spares most of them that.
+    uint32_t size = db_size(view);
+    char *body = malloc(size);
+    int ret = body ? db_decode(view, body) : ERR;
+    db_release(view->pin);
+    if (ret != OK) {
+        free(body);
+        send_response(req, HTTP_STATUS_500, NULL, 0);
+        return;
+    }
+    entry = cacheable ? cache_response(req, key, body, size, view->expires) : NULL;
+    if (entry) {
+        send_response_raw(req, entry->data, entry->len, release_entry, entry);
+    } else {
+        send_response(req, HTTP_STATUS_200, body, size);
+    }
+    free(body);
+}
+
+// The reads of all of the pastes go to the disk together
+static void get_run(struct io_job **jobs, uint32_t count)
+{
+    struct db_view *views[IO_BATCH];
+    for (uint32_t i = 0; i < count; i++)
+        views[i] = &container_of(jobs[i], struct get_op, job)->view;
+    db_prefetch(container_of(jobs[0], struct get_op, job)->db, views, count);
+}
+
+static void get_done(struct io_job *job)
+{
+    struct get_op *op = container_of(job, struct get_op, job);
+    serve_paste(op->req, &op->view, op->key, op->cacheable, op->gzip);
+    free(op);
+}
+
 static void get_callback(struct request *req, void *data)
 {
     struct db *db = data;
@@ -146,16 +315,89 @@ static void get_callback(struct request *req, void *data)
         }
     }
 
+    int accept_len;
+    const char *accept = get_header(req, HTTP_HKEY_ACCEPT_ENCODING, &accept_len);
+    bool gzip = accept && http_accepts_coding(accept, accept_len, "gzip");
+
     dbid_t id = strtoull(uri+1, NULL, 10);
-    uint32_t entry_len;
-    void *entry = db_get(db, id, &entry_len);
+    // Pastes never change, so neither do the responses serving them. They're
+    // cached whole, per HTTP version, keep-alive and gzip support, and sent as
+    // they are. Ids too large for the key can't exist, the database lookup
+    // fails them.
+    bool cacheable = cask.cache && id <= (UINT64_MAX >> RESPONSE_KEY_BITS);
+    uint64_t key = (id << RESPONSE_KEY_BITS) | (response_variant(req) << 1) | gzip;
+    struct cache_entry *entry = cacheable ? cache_get(cask.cache, key) : NULL;
     if (entry) {
-        send_response(req, HTTP_STATUS_200, entry, entry_len);
-        free(entry);
-    } else {
+        send_response_raw(req, entry->data, entry->len, release_entry, entry);
+        return;
+    }
+
+    struct db_view view;
+    if (db_get(db, id, &view) != OK) {
         static const char resp[] = "Paste not found";
         send_response(req, HTTP_STATUS_404, resp, strlen(resp));
+        return;
+    }
+
+    // NOTE: Pastes that aren't in memory are read in on the I/O threads, so
+    // that the worker's other connections don't wait for the disk. Everything
+    // else is served right away.
+    struct get_op *op = (cask.io && !db_resident(&view)) ? malloc(sizeof *op) : NULL;
+    if (op) {
+        op->job.run = NULL;
+        op->job.run_batch = get_run;
+        op->job.done = get_done;
+        op->req = req;
+        op->db = db;
+        op->view = view;
+        op->key = key;
+        op->cacheable = cacheable;
+        op->gzip = gzip;
+        defer_response(req, &op->job);
+        return;
+    }
+    // In direct mode, a paste missing from the buffer pool has no data until read in
+    if (!view.data) {
+        struct db_view *views[1] = {&view};
+        db_prefetch(db, views, 1);
+    }
+    serve_paste(req, &view, key, cacheable, gzip);
+}
+
+// Parses the X-TTL header, a positive number of seconds
+static int parse_ttl(const char *s, int len, uint32_t *ttl)
+{
+    uint64_t n = 0;
+    for (int i = 0; i < len; i++) {
+        if (!isdigit(s[i]) || n > UINT32_MAX)
+            return ERR;
+        n = n * 10 + (uint64_t)(s[i] - '0');
+    }
+    if (n == 0 || n > UINT32_MAX)
+        return ERR;
+    *ttl = (uint32_t)n;
+    return OK;
+}
+
+// Inserts, compression included, may wait for the disk: with durability
+// enabled, always
+static void post_run(struct io_job *job)
+{
+    struct post_op *op = container_of(job, struct post_op, job);
+    op->ret = db_insert(op->db, op->body, op->len, op->ttl, &op->id);
+}
+
+static void post_done(struct io_job *job)
+{
+    struct post_op *op = container_of(job, struct post_op, job);
+    if (op->ret != OK) {
+        send_response(op->req, HTTP_STATUS_500, NULL, 0);
+    } else {
+        char tmp[20];
+        int len = snprintf(tmp, 20, "%lu", op->id); // NOLINT [C11 Annex K]
+        send_response(op->req, HTTP_STATUS_200, tmp, (size_t)len);
     }
+    free(op);
 }
 
 static void post_callback(struct request *req, void *data)
@@ -166,16 +408,33 @@ static void post_callback(struct request *req, void *data)
     if (len == 0) {
         static const char resp[] = "Error: Zero length paste";
         send_response(req, HTTP_STATUS_400, resp, strlen(resp));
-    } else {
-        dbid_t id;
-        if (db_insert(db, body, (uint32_t)len, &id) != OK) {
-            send_response(req, HTTP_STATUS_500, NULL, 0);
-        } else {
-            char tmp[20];
-            len = snprintf(tmp, 20, "%lu", id); // NOLINT [C11 Annex K]
-            send_response(req, HTTP_STATUS_200, tmp, (size_t)len);
-        }
+        return;
+    }
+
+    uint32_t ttl = 0;
+    int ttl_len;
+    const char *ttl_val = get_header(req, HTTP_HKEY_TTL, &ttl_len);
+    if (ttl_val && parse_ttl(ttl_val, ttl_len, &ttl) != OK) {
+        static const char resp[] = "Error: Invalid TTL";
+        send_response(req, HTTP_STATUS_400, resp, strlen(resp));
+        return;
+    }
+
+    // The body stays in the connection's buffer until the response is sent
+    struct post_op *op = malloc(sizeof *op);
+    if (!op) {
+        send_response(req, HTTP_STATUS_500, NULL, 0);
+        return;
     }
+    op->job.run = post_run;
+    op->job.run_batch = NULL;
+    op->job.done = post_done;
+    op->req = req;
+    op->db = db;
+    op->body = body;
+    op->len = (uint32_t)len;
+    op->ttl = ttl;
+    defer_response(req, &op->job);
 }
 
 int main(int argc, char *argv[])
@@ -187,11 +446,24 @@ int main(int argc, char *argv[])
 
     const char *port = PORT;
     uint32_t num_workers = NUM_WORKERS;
+    uint32_t num_io_threads = NUM_IO_THREADS;
     const char *db_path = DB_PATH;
-    size_t num_buckets = DB_NUM_BUCKETS;
+    size_t capacity = DB_CAPACITY;
+    enum db_durability durability = DB_DURABILITY_NONE;
+    size_t cache_size = CACHE_SIZE;
+    int compression = 0;
+    bool dedup = false;
+    bool huge_pages = false;
+    bool prefault = false;
+    uint32_t inline_max = DB_INLINE_MAX;
+    bool io_uring = false;
+    size_t buffer_pool = 0;
+    uint32_t compact_interval = DB_COMPACT_INTERVAL;
+    uint64_t compact_rate = DB_COMPACT_RATE;
+    uint32_t snapshot_interval = DB_SNAPSHOT_INTERVAL;
     const char *ipc_sock_path = IPC_SOCK_PATH;
     int opt;
-    while ((opt = getopt(argc, argv, "hp:w:d:b:s:")) != -1) {
+    while ((opt = getopt(argc, argv, "hp:w:t:E:T:S:d:b:D:z:eI:HPuB:k:K:i:c:s:")) != -1) {
         switch (opt) {
             case 'p': {
                 for (size_t i = 0; i < strlen(optarg); i++) {
@@ -211,14 +483,153 @@ int main(int argc, char *argv[])
                 num_workers = (uint32_t)n;
             } break;
 
+            case 't': {
+                char *end;
+                uint64_t n = strtoull(optarg, &end, 10);
+                if (*end || end == optarg || n > UINT32_MAX) {
+                    fprintf(stderr, "Invalid I/O thread count\n");
+                    return 1;
+                }
+                num_io_threads = (uint32_t)n;
+            } break;
+
+            case 'E': {
+                if (strcmp(optarg, "epoll") == 0) {
+                    cask.events = EVENT_BACKEND_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    cask.events = EVENT_BACKEND_URING;
+                } else {
+                    fprintf(stderr, "Events must be one of epoll or uring\n");
+                    return 1;
+                }
+            } break;
+
+            case 'T': {
+                if (strcmp(optarg, "tree") == 0) {
+                    cask.timers = EVENT_TIMERS_TREE;
+                } else if (strcmp(optarg, "wheel") == 0) {
+                    cask.timers = EVENT_TIMERS_WHEEL;
+                } else {
+                    fprintf(stderr, "Timers must be one of tree or wheel\n");
+                    return 1;
+                }
+            } break;
+
+            case 'S': {
+                char *end;
+                uint64_t n = strtoull(optarg, &end, 10);
+                if (*end || end == optarg || n > UINT32_MAX) {
+                    fprintf(stderr, "Invalid busy poll time\n");
+                    return 1;
+                }
+                cask.busy_poll = (uint32_t)n;
+            } break;
+
             case 'd': {
                 db_path = optarg;
             } break;
 
             case 'b': {
-                num_buckets = strtoull(optarg, NULL, 10);
-                if (num_buckets == 0) {
-                    fprintf(stderr, "Number of database hash table buckets must be > 0\n");
+                capacity = strtoull(optarg, NULL, 10);
+                if (capacity == 0) {
+                    fprintf(stderr, "Initial database index capacity must be > 0\n");
+                    return 1;
+                }
+            } break;
+
+            case 'D': {
+                if (strcmp(optarg, "none") == 0) {
+                    durability = DB_DURABILITY_NONE;
+                } else if (strcmp(optarg, "group") == 0) {
+                    durability = DB_DURABILITY_GROUP;
+                } else if (strcmp(optarg, "always") == 0) {
+                    durability = DB_DURABILITY_ALWAYS;
+                } else {
+                    fprintf(stderr, "Durability must be one of none, group or always\n");
+                    return 1;
+                }
+            } break;
+
+            case 'z': {
+                char *end;
+                long level = strtol(optarg, &end, 10);
+                if (*end || end == optarg || level < 0 || level > 9) {
+                    fprintf(stderr, "Compression level must be between 0 and 9\n");
+                    return 1;
+                }
+                compression = (int)level;
+            } break;
+
+            case 'e': {
+                dedup = true;
+            } break;
+
+            case 'I': {
+                char *end;
+                uint64_t n = strtoull(optarg, &end, 10);
+                if (*end || end == optarg || n > DB_INLINE_MAX) {
+                    fprintf(stderr, "Inline size must be between 0 and %d\n", DB_INLINE_MAX);
+                    return 1;
+                }
+                inline_max = (uint32_t)n;
+            } break;
+
+            case 'H': {
+                huge_pages = true;
+            } break;
+
+            case 'P': {
+                prefault = true;
+            } break;
+
+            case 'u': {
+                io_uring = true;
+            } break;
+
+            case 'B': {
+                char *end;
+                uint64_t n = strtoull(optarg, &end, 10);
+                if (*end || end == optarg || n > SIZE_MAX / 1024 / 1024) {
+                    fprintf(stderr, "Invalid buffer pool size\n");
+                    return 1;
+                }
+                buffer_pool = (size_t)n * 1024 * 1024;
+            } break;
+
+            case 'k': {
+                char *end;
+                uint64_t n = strtoull(optarg, &end, 10);
+                if (*end || end == optarg || n > UINT32_MAX) {
+                    fprintf(stderr, "Invalid compaction interval\n");
+                    return 1;
+                }
+                compact_interval = (uint32_t)n;
+            } break;
+
+            case 'K': {
+                char *end;
+                compact_rate = strtoull(optarg, &end, 10);
+                if (*end || end == optarg || compact_rate == 0) {
+                    fprintf(stderr, "Compaction rate must be > 0\n");
+                    return 1;
+                }
+            } break;
+
+            case 'i': {
+                char *end;
+                uint64_t n = strtoull(optarg, &end, 10);
+                if (*end || end == optarg || n > UINT32_MAX) {
+                    fprintf(stderr, "Invalid snapshot interval\n");
+                    return 1;
+                }
+                snapshot_interval = (uint32_t)n;
+            } break;
+
+            case 'c': {
+                char *end;
+                cache_size = strtoull(optarg, &end, 10);
+                if (*end || end == optarg) {
+                    fprintf(stderr, "Invalid cache size\n");
                     return 1;
                 }
             } break;
@@ -237,10 +648,26 @@ int main(int argc, char *argv[])
                     " Server:\n\n"
                     "  -p PORT\tPort\n\n"
                     "Threading:\n\n"
-                    "  -w WORKERS\tNumber of worker threads\n\n"
+                    "  -w WORKERS\tNumber of worker threads\n"
+                    "  -t THREADS\tNumber of database I/O threads, 0 does it on the workers (default 4)\n"
+                    "  -E EVENTS\tHow workers wait for network I/O: epoll (default) or uring (io_uring, if the kernel has it)\n"
+                    "  -T TIMERS\tHow workers keep connection timers: tree (default) or wheel (timing wheel)\n"
+                    "  -S MICROSECONDS\tSpin for network I/O this long before sleeping, 0 disables it (default)\n\n"
                     "Database:\n\n"
                     "  -d DBPATH\tDatabase file path\n"
-                    "  -b BUCKETS\tNumber of database hash table buckets\n\n"
+                    "  -b CAPACITY\tInitial number of database index entries\n"
+                    "  -D MODE\tDurability: none (default), group (batched fsync) or always (fsync per write)\n"
+                    "  -z LEVEL\tgzip compression level (1-9) for new pastes, 0 disables it (default)\n"
+                    "  -e\t\tStore pastes equal to an earlier one only once\n"
+                    "  -I BYTES\tKeep pastes up to this size in the index, 0 disables it (default 40)\n"
+                    "  -H\t\tBack the index with transparent huge pages\n"
+                    "  -P\t\tRead the whole index into memory on startup\n"
+                    "  -u\t\tDo database I/O through io_uring, if the kernel has it\n"
+                    "  -B MEGABYTES\tUse O_DIRECT for the database, with a buffer pool of this size, 0 disables it (default)\n"
+                    "  -k SECONDS\tInterval between compaction passes, 0 disables compaction (default 60)\n"
+                    "  -K MB/S\tCompaction rate limit in megabytes per second (default 16)\n"
+                    "  -i SECONDS\tInterval between index snapshots, 0 only takes one on exit (default 300)\n"
+                    "  -c MEGABYTES\tSize of the cache of popular pastes, 0 disables it (default 64)\n\n"
                     "Misc:\n\n"
                     "  -s SOCKPATH\tSocket path used for IPC listen\n\n",
                     argv[0]);
@@ -264,6 +691,10 @@ int main(int argc, char *argv[])
     struct sigaction sa = {0};
     sa.sa_handler = sighandler;
     sigaction(SIGINT, &sa, NULL);
+    // NOTE: A peer that goes away mid-response must only fail the send.
+    // sendfile has no MSG_NOSIGNAL, so the signal is ignored altogether.
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 
     // Block SIGINT
     sigset_t mask, orig_mask;
@@ -289,17 +720,55 @@ int main(int argc, char *argv[])
 
     // Database
     struct db_params params;
-    params.num_buckets = num_buckets;
+    params.capacity = capacity;
+    params.durability = durability;
+    params.commit_window = DB_COMMIT_WINDOW;
+    params.compression = compression;
+    params.dedup = dedup;
+    params.inline_max = inline_max;
+    params.huge_pages = huge_pages;
+    params.prefault = prefault;
+    params.compact_interval = compact_interval;
+    params.compact_rate = compact_rate * 1024 * 1024;
+    params.snapshot_interval = snapshot_interval;
+    params.io_uring = io_uring;
+    params.buffer_pool = buffer_pool;
     struct db *db = open_db(db_path, &params);
     if (!db) {
         fprintf(stderr, "[FATAL] Main: open_db\n");
         freeaddrinfo(cask.ai);
         return 1;
     }
+    cask.db = db;
+
+    // Cache
+    if (cache_size) {
+        cask.cache = create_cache(cache_size * 1024 * 1024);
+        if (!cask.cache) {
+            fprintf(stderr, "[FATAL] Main: create_cache\n");
+            close_db(db);
+            freeaddrinfo(cask.ai);
+            return 1;
+        }
+    }
+
+    // Database I/O threads
+    if (num_io_threads) {
+        cask.io = create_io_pool(num_io_threads);
+        if (!cask.io) {
+            fprintf(stderr, "[FATAL] Main: create_io_pool\n");
+            destroy_cache(cask.cache);
+            close_db(db);
+            freeaddrinfo(cask.ai);
+            return 1;
+        }
+    }
 
     // IPC socket
     cask.ipcfd = setup_ipc(ipc_sock_path);
     if (cask.ipcfd < 0) {
+        destroy_io_pool(cask.io);
+        destroy_cache(cask.cache);
         close_db(db);
         freeaddrinfo(cask.ai);
         return 1;
@@ -343,17 +812,21 @@ int main(int argc, char *argv[])
     }
 
 out:;
+    // NOTE: The workers go first, their connections may still hold on to
+    // the database and the cache.
+    struct list *iter, *next;
+    list_for_each_safe(iter, next, &cask.workers) {
+        struct worker *worker = list_entry(iter, struct worker, node);
+        shutdown_worker(worker);
+    }
     freeaddrinfo(cask.ai);
     pthread_mutex_destroy(&cask.worker_lock);
     close(cask.ipcfd);
     unlink(ipc_sock_path);
     unmap_file(&file);
+    destroy_io_pool(cask.io);
+    destroy_cache(cask.cache);
     close_db(db);
-    struct list *iter, *next;
-    list_for_each_safe(iter, next, &cask.workers) {
-        struct worker *worker = list_entry(iter, struct worker, node);
-        shutdown_worker(worker);
-    }
 
     return exit_code;
 }
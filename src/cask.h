@@ -2,10 +2,15 @@
 #define CASK_H
 
 #include "common.h"
+#include "event.h"
 #include "list.h"
 #include <netdb.h>
 #include <pthread.h>
 
+struct db;
+struct cache;
+struct io_pool;
+
 struct cask
 {
     volatile bool running;
@@ -13,12 +18,23 @@ struct cask
 
     struct addrinfo *ai;
 
+    // How the workers wait for network I/O, and keep their timers
+    enum event_backend events;
+    enum event_timers timers;
+    // Microseconds the workers spin for network I/O before sleeping
+    uint32_t busy_poll;
+
     pthread_mutex_t worker_lock;
     thread_id current_id;
     uint32_t num_workers;
     struct list workers;
 
     int ipcfd;
+
+    struct db *db;
+    struct cache *cache;
+    // NULL if database I/O is done on the workers
+    struct io_pool *io;
 };
 
 extern struct cask *g_cask;
@@ -1,28 +1,71 @@
 #include "shared.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+static int request_resize(int fd, uint32_t capacity)
+{
+    struct ipc_request req = {IPC_CMD_RESIZE, capacity};
+    if (write(fd, &req, sizeof req) != sizeof req) {
+        perror("Main: write");
+        close(fd);
+        return 1;
+    }
+
+    uint32_t command;
+    int32_t result;
+    if (read(fd, &command, sizeof command) != sizeof command ||
+        read(fd, &result, sizeof result) != sizeof result) {
+        perror("Main: read");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    if (command != IPC_CMD_RESIZE) {
+        fprintf(stderr, "IPC_CMD_RESIZE: Invalid response from server: %u\n", command);
+        return 1;
+    }
+    if (result != OK) {
+        fprintf(stderr, "Failed to resize the index to %u entries\n", capacity);
+        return 1;
+    }
+    fprintf(stderr, "Resized the index to %u entries\n", capacity);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int opt;
-    while ((opt = getopt(argc, argv, "h")) != -1) {
+    uint32_t resize = 0;
+    while ((opt = getopt(argc, argv, "hr:")) != -1) {
         switch (opt) {
             case 'h': {
                 fprintf(stderr, "Usage:\n\n"
-                    "  %s socket-path\n\n", argv[0]);
+                    "  %s [-r capacity] socket-path\n\n"
+                    "Options:\n"
+                    "  -r: Grow the database index to the given capacity\n\n", argv[0]);
                 return 1;
             }
 
+            case 'r': {
+                unsigned long value = strtoul(optarg, NULL, 10);
+                if (value == 0 || value > UINT32_MAX) {
+                    fprintf(stderr, "Invalid index capacity: %s\n", optarg);
+                    return 1;
+                }
+                resize = (uint32_t)value;
+            } break;
+
             default: {
                 return 1;
             }
         }
     }
 
-    if (argc < 2) {
+    if (optind >= argc) {
         fprintf(stderr, "A socket path must be provided\n");
         return 1;
     }
@@ -34,13 +77,16 @@ int main(int argc, char *argv[])
     }
     struct sockaddr_un addr;
     addr.sun_family = AF_UNIX;
-    memcpy(addr.sun_path, argv[1], strlen(argv[1])); // NOLINT [C11 Annex K]
+    memcpy(addr.sun_path, argv[optind], strlen(argv[optind]) + 1); // NOLINT [C11 Annex K]
     if (connect(fd, &addr, sizeof(addr)) < 0) {
         perror("Main: connect");
         close(fd);
         return 1;
     }
 
+    if (resize)
+        return request_resize(fd, resize);
+
     struct ipc_request req = {IPC_CMD_STATUS, 0};
     if (write(fd, &req, sizeof req) != sizeof req) {
         perror("Main: write");
@@ -69,10 +115,23 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    uint64_t lookups = status.cache_hits + status.cache_misses;
     fprintf(stderr, "Status: \n"
         "Uptime: %lu seconds\n"
-        "Number of workers: %u\n",
-        status.uptime, status.num_workers);
+        "Number of workers: %u\n"
+        "Database records: %lu\n"
+        "Database index: %lu entries (%.1f%% used)\n"
+        "Deduplicated pastes: %lu\n"
+        "Expired pastes: %lu, %lu bytes reclaimed by compaction\n"
+        "Cache: %lu hits, %lu misses (%.1f%% hit ratio), %lu evictions, %lu bytes\n"
+        "Page faults: %lu minor, %lu major\n",
+        status.uptime, status.num_workers, status.db_count, status.db_capacity,
+        status.db_capacity ? 100.0 * (double)status.db_count / (double)status.db_capacity : 0.0,
+        status.db_dedup_hits,
+        status.db_expired, status.db_reclaimed,
+        status.cache_hits, status.cache_misses, lookups ? 100.0 * (double)status.cache_hits / (double)lookups : 0.0,
+        status.cache_evictions, status.cache_bytes,
+        status.minor_faults, status.major_faults);
 
     // Read payload
     for (uint32_t i = 0; i < status.num_workers; i++) {
@@ -85,9 +144,13 @@ int main(int argc, char *argv[])
 
         fprintf(stderr, "  Worker #%lu:\n"
             "  Status: %s\n"
-            "  Number of connections: %lu\n\n",
+            "  Number of connections: %lu\n"
+            "  Requests: %lu (%.1f system calls each)\n\n",
             worker_status.id, worker_status.running ? "Running" : "Terminated",
-            worker_status.num_conns);
+            worker_status.num_conns, worker_status.num_requests,
+            worker_status.num_requests ?
+                (double)worker_status.syscalls /
+                    (double)worker_status.num_requests : 0.0);
     }
 
     close(fd);
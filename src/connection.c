@@ -7,11 +7,13 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 // NOTE: Milliseconds
 #define TIMEOUT 5000
 #define READ_CHUNK 4096
-#define WRITE_CHUNK 4096
 
 static void timeout_callback(void *data)
 {
@@ -19,6 +21,33 @@ static void timeout_callback(void *data)
     close_connection(c);
 }
 
+// Parses what has been received so far, and serves the request once complete
+static inline void process_request(struct connection *c)
+{
+    struct request *req = &c->req;
+    buffer_t *buf = c->buffer;
+
+    int ret = parse_request(req);
+    if (ret == REQ_OK) {
+        c->worker->num_requests++;
+        // Request receive complete. Parse
+        const char *uri = buf->data + req->uri.off;
+        const struct route *route = match_route(req->method, uri, (size_t)req->uri.len);
+        if (route) {
+            // Route found, call the callback
+            route->cb(req, route->data);
+        } else {
+            // Route not found
+            // TODO: a better 404 callback
+            route_404(req);
+        }
+    } else if (ret == REQ_ERR) {
+        // Bad request.
+        // TODO: Send HTTP bad request?
+        close_connection(c);
+    }
+}
+
 static inline void read_data(struct connection *c)
 {
     buffer_t *buf = c->buffer;
@@ -34,32 +63,13 @@ static inline void read_data(struct connection *c)
         }
 
         ssize_t num_read = recv(c->fd, buf->data + buf->size, READ_CHUNK, 0);
+        count_syscalls(c->worker->base, 1);
         if (num_read < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                struct request *req = &c->req;
-
-                int ret = parse_request(req);
-                if (ret == REQ_OK) {
-                    // Request receive complete. Parse
-                    const char *uri = buf->data + req->uri.off;
-                    const struct route *route = match_route(req->method, uri, (size_t)req->uri.len);
-                    if (route) {
-                        // Route found, call the callback
-                        route->cb(req, route->data);
-                    } else {
-                        // Route not found
-                        // TODO: a better 404 callback
-                        route_404(req);
-                    }
-                } else if (ret == REQ_ERR) {
-                    // Bad request.
-                    // TODO: Send HTTP bad request?
-                    close_connection(c);
-                } else {
-                    // Request underflow, need more data. Keep reading.
-                    continue;
-                }
+                process_request(c);
 
+                // NOTE: On a request underflow, more data is needed. It arrives
+                // with the next EPOLLIN, so don't spin on recv waiting for it.
                 break;
             } else {
                 perror("Connection: read_data recv error\n");
@@ -77,61 +87,206 @@ static inline void read_data(struct connection *c)
     }
 }
 
+// Accounts for data sent, and once the whole response is, moves on. Returns
+// false if there is more to send.
+static inline bool sent_data(struct connection *c, size_t num_sent)
+{
+    c->write_bytes += num_sent;
+    if (c->write_bytes < c->buffer->size + c->body_len)
+        return false;
+    if (c->flags & CONNECTION_FLAG_KEEPALIVE) {
+        // Reset the connection back to IN state
+        begin_read(c);
+    } else {
+        // No keep-alive and the request has been served. Close connection
+        close_connection(c);
+    }
+    return true;
+}
+
+static void sent_callback(int32_t res, const char *data, void *arg);
+static void writable_callback(int32_t res, const char *data, void *arg);
+
+// Sends the rest once there is room in the socket buffer (io_uring)
+static inline void wait_writable(struct connection *c)
+{
+    c->out.events = EPOLLOUT;
+    c->out.done = writable_callback;
+    if (submit_poll(c->worker->base, &c->out) != OK) {
+        fprintf(stderr, "Connection: submit_poll error\n");
+        close_connection(c);
+    }
+}
+
 // NOTE: This function might close the connection if it encounters an error.
 // Wherever this gets called from, should not touch the connection afterwards
 // TODO: This could be slightly more elegant.
+// NOTE: With io_uring, the buffer and the borrowed body are sent by the base,
+// as part of its next wait. There's no sendfile there, file bodies still go
+// out from here, waiting for room with a poll.
 static inline void send_data(struct connection *c)
 {
     buffer_t *buf = c->buffer;
+    size_t total = buf->size + c->body_len;
+    bool ops = event_base_ops(c->worker->base);
     while (1) {
-        size_t rem = buf->size - c->write_bytes;
-        size_t len = (rem < WRITE_CHUNK) ? rem : WRITE_CHUNK;
-        ssize_t num_sent = send(c->fd, buf->data + c->write_bytes, len, 0);
+        ssize_t num_sent;
+        if (c->body_fd >= 0 && c->write_bytes >= buf->size) {
+            // File body, resumes from wherever the previous call left off
+            off_t off = c->body_off + (off_t)(c->write_bytes - buf->size);
+            num_sent = sendfile(c->fd, c->body_fd, &off, total - c->write_bytes);
+            count_syscalls(c->worker->base, 1);
+            if (num_sent == 0) {
+                fprintf(stderr, "Connection: send_data sendfile short read\n");
+                close_connection(c);
+                break;
+            }
+        } else {
+            // Headers (and copied bodies) from the buffer, followed by the borrowed body
+            struct iovec *iov = c->iov;
+            int iovcnt = 0;
+            if (c->write_bytes < buf->size) {
+                iov[iovcnt].iov_base = buf->data + c->write_bytes;
+                iov[iovcnt].iov_len = buf->size - c->write_bytes;
+                iovcnt++;
+            }
+            if (c->body) {
+                size_t off = (c->write_bytes > buf->size) ? c->write_bytes - buf->size : 0;
+                iov[iovcnt].iov_base = (void *)(uintptr_t)(c->body + off);
+                iov[iovcnt].iov_len = c->body_len - off;
+                iovcnt++;
+            }
+
+            // With a file body, hold the headers back so they go out together with it
+            struct msghdr *msg = &c->msg;
+            zero_structp(msg);
+            msg->msg_iov = iov;
+            msg->msg_iovlen = (size_t)iovcnt;
+            int flags = (c->body_fd >= 0) ? MSG_MORE : 0;
+            if (ops) {
+                c->out.done = sent_callback;
+                if (submit_send(c->worker->base, &c->out, msg, flags) != OK) {
+                    fprintf(stderr, "Connection: send_data submit_send error\n");
+                    close_connection(c);
+                }
+                break;
+            }
+            num_sent = sendmsg(c->fd, msg, flags);
+            count_syscalls(c->worker->base, 1);
+        }
+
         if (num_sent < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (ops)
+                    wait_writable(c);
                 break;
             } else {
                 perror("Connection: send_data send error");
                 close_connection(c);
                 break;
             }
-        } else {
-            c->write_bytes += (size_t)num_sent;
-            if (c->write_bytes == buf->size) {
-                if (c->flags & CONNECTION_FLAG_KEEPALIVE) {
-                    // Reset the connection back to IN state
-                    begin_read(c);
-                } else {
-                    // No keep-alive and the request has been served. Close connection
-                    close_connection(c);
-                }
-                break;
+        } else if (sent_data(c, (size_t)num_sent)) {
+            break;
+        }
+    }
+}
+
+static void free_connection(struct connection *c);
+
+// Completion of a send, or of the wait for room to send a file body
+static void sent_callback(int32_t res, const char *data, void *arg)
+{
+    UNUSED(data);
+    struct connection *c = arg;
+    if (c->flags & CONNECTION_FLAG_CLOSING) {
+        free_connection(c);
+    } else if (res == -EAGAIN) {
+        // NOTE: The socket is non-blocking for sendfile, and io_uring honours
+        // that, so a send into a full socket buffer fails instead of waiting.
+        wait_writable(c);
+    } else if (res < 0) {
+        fprintf(stderr, "Connection: send error: %s\n", strerror(-res));
+        close_connection(c);
+    } else if (!sent_data(c, (size_t)res)) {
+        send_data(c);
+    }
+}
+
+static void writable_callback(int32_t res, const char *data, void *arg)
+{
+    UNUSED(res);
+    UNUSED(data);
+    struct connection *c = arg;
+    if (c->flags & CONNECTION_FLAG_CLOSING)
+        free_connection(c);
+    else
+        send_data(c);
+}
+
+// NOTE: Everything that arrives is received, whatever the state. Data for the
+// next request, or the end of the stream, is kept for begin_read.
+static void recv_callback(int32_t res, const char *data, void *arg)
+{
+    struct connection *c = arg;
+    if (c->state != CONNECTION_STATE_IN) {
+        if (res > 0) {
+            if (!c->pending)
+                c->pending = create_buffer();
+            if (!c->pending || push_buffer(c->pending, data, (size_t)res) != OK) {
+                fprintf(stderr, "Connection: recv_callback push_buffer error\n");
+                c->flags |= CONNECTION_FLAG_ERROR;
             }
+        } else if (res < 0) {
+            if (res != -ECONNRESET)
+                fprintf(stderr, "Connection: recv error: %s\n", strerror(-res));
+            c->flags |= CONNECTION_FLAG_ERROR;
+        } else {
+            c->flags |= CONNECTION_FLAG_EOF;
         }
+        c->flags |= CONNECTION_FLAG_READABLE;
+        return;
+    }
+
+    if (res > 0) {
+        if (push_buffer(c->buffer, data, (size_t)res) != OK) {
+            fprintf(stderr, "Connection: recv_callback push_buffer error\n");
+            c->state = CONNECTION_STATE_ERROR;
+            close_connection(c);
+            return;
+        }
+        process_request(c);
+    } else {
+        if (res < 0 && res != -ECONNRESET)
+            fprintf(stderr, "Connection: recv error: %s\n", strerror(-res));
+        c->state = res ? CONNECTION_STATE_ERROR : CONNECTION_STATE_CLOSED;
+        close_connection(c);
     }
 }
 
+// NOTE: The socket is registered once, for both directions, and edge-triggered.
+// Events for the direction the connection isn't in are dropped, except that data
+// arriving meanwhile is noted, as its edge won't come again.
 static void io_callback(int fd, uint32_t events, void *data)
 {
     UNUSED(fd);
     struct connection *c = data;
     switch (c->state) {
         case CONNECTION_STATE_IN: {
-            if (events & EPOLLIN) {
+            if (events & (EPOLLIN|EPOLLERR|EPOLLHUP))
                 read_data(c);
-            } else {
-                fprintf(stderr, "Connection: io_callback state mismatch\n");
-                close_connection(c);
-            }
         } break;
 
         case CONNECTION_STATE_OUT: {
-            if (events & EPOLLOUT) {
+            if (events & EPOLLIN)
+                c->flags |= CONNECTION_FLAG_READABLE;
+            if (events & (EPOLLOUT|EPOLLERR|EPOLLHUP))
                 send_data(c);
-            } else {
-                fprintf(stderr, "Connection: io_callback state mismatch\n");
-                close_connection(c);
-            }
+        } break;
+
+        case CONNECTION_STATE_WAIT: {
+            // Picked up again once the job is done
+            if (events & EPOLLIN)
+                c->flags |= CONNECTION_FLAG_READABLE;
         } break;
 
         case CONNECTION_STATE_CLOSED:
@@ -146,17 +301,32 @@ int accept_connection(struct worker *worker)
 {
     struct sockaddr_storage addr;
     socklen_t len = sizeof addr;
-    int fd = accept(worker->sock, (struct sockaddr *)&addr, &len);
+    int fd;
+    do {
+        fd = accept(worker->sock, (struct sockaddr *)&addr, &len);
+        count_syscalls(worker->base, 1);
+        // NOTE: A connection that was reset while queued is gone, but the ones
+        // queued behind it are still there.
+    } while (fd < 0 && (errno == EINTR || errno == ECONNABORTED));
     if (fd < 0) {
-        perror("Connection: accept");
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("Connection: accept");
         return ERR;
     }
+    count_syscalls(worker->base, 1);
     if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
         perror("Connection: fcntl");
         close(fd);
-        return ERR;
+        return OK;
     }
+    // NOTE: Failing to set up this connection drops it, but doesn't stop
+    // accepting the rest.
+    open_connection(worker, fd);
+    return OK;
+}
 
+int open_connection(struct worker *worker, int fd)
+{
     struct connection *c = calloc(1, sizeof *c);
     if (c) {
         buffer_t *buffer = create_buffer();
@@ -170,7 +340,27 @@ int accept_connection(struct worker *worker)
         c->fd = fd;
         c->worker = worker;
         c->buffer = buffer;
+        c->timer = make_timer(TIMEOUT, TIMER_FLAG_ONESHOT, timeout_callback, c);
+        c->state = CONNECTION_STATE_WAIT;
+        int ret;
+        if (event_base_ops(worker->base)) {
+            c->event = make_op(fd, recv_callback, c);
+            c->out = make_op(fd, sent_callback, c);
+            ret = submit_recv(worker->base, &c->event);
+        } else {
+            c->event = make_event(fd, EPOLLIN|EPOLLOUT|EPOLLET, io_callback, c);
+            ret = add_event(worker->base, &c->event);
+        }
+        if (ret != OK) {
+            fprintf(stderr, "Connection: add_event error\n");
+            free_buffer(buffer);
+            close(fd);
+            free(c);
+            return ERR;
+        }
         list_add_entry_tail(&worker->conns, c, node);
+        // NOTE: The decrement is done in close_connection
+        worker->num_conns++;
         begin_read(c);
     } else {
         perror("Connection: calloc");
@@ -180,16 +370,44 @@ int accept_connection(struct worker *worker)
     return OK;
 }
 
+static inline void release_body(struct connection *c)
+{
+    if (c->body_release) {
+        c->body_release(c->body_release_data);
+        c->body_release = NULL;
+    }
+}
+
+static void free_connection(struct connection *c)
+{
+    release_body(c);
+    free_buffer(c->buffer);
+    if (c->pending)
+        free_buffer(c->pending);
+    free(c);
+}
+
 void close_connection(struct connection *c)
 {
     struct worker *worker = c->worker;
     worker->num_conns--;
     del_event(worker->base, &c->event);
     del_timer(worker->base, &c->timer);
-    close(c->fd);
     list_del_entry(c, node);
-    free_buffer(c->buffer);
-    free(c);
+    if (!event_base_ops(worker->base)) {
+        close(c->fd);
+        count_syscalls(worker->base, 1);
+    } else {
+        submit_close(worker->base, c->fd);
+        // The send goes on with the memory of the connection, so it is only
+        // freed once that completes
+        if (c->out.flags & EVENT_FLAG_ACTIVE) {
+            c->flags |= CONNECTION_FLAG_CLOSING;
+            cancel_op(worker->base, &c->out);
+            return;
+        }
+    }
+    free_connection(c);
 }
 
 // NOTE: This function does not clear the buffer, because it can be called from begin_send
@@ -201,57 +419,69 @@ int reset_connection(struct connection *c)
     zero_struct(c->req);
     c->write_bytes = 0;
 
-    // Reset the timer
-    if (c->timer.flags & TIMER_FLAG_ACTIVE)
-        del_timer(worker->base, &c->timer);
-
-    c->timer = make_timer(TIMEOUT, TIMER_FLAG_ONESHOT, timeout_callback, c);
-    if (add_timer(worker->base, &c->timer) != OK) {
-        fprintf(stderr, "Connection: reset_connection add_timer error\n");
+    // NOTE: Pushes the timeout back. Most connections never reach it, so the
+    // timer is only moved if it comes due in the meantime.
+    if (touch_timer(worker->base, &c->timer) != OK) {
+        fprintf(stderr, "Connection: reset_connection touch_timer error\n");
         return ERR;
     }
-
-    if (c->event.flags & EVENT_FLAG_ACTIVE)
-        del_event(worker->base, &c->event);
-
     return OK;
 }
 
 void begin_read(struct connection *c)
 {
-    struct worker *worker = c->worker;
-
     if (reset_connection(c) != OK) {
         close_connection(c);
         return;
     }
 
     clear_buffer(c->buffer);
+    release_body(c);
+    c->body = NULL;
+    c->body_fd = -1;
+    c->body_len = 0;
     c->state = CONNECTION_STATE_IN;
-    c->event = make_event(c->fd, EPOLLIN|EPOLLET, io_callback, c);
-    if (add_event(worker->base, &c->event) != OK) {
-        fprintf(stderr, "Connection: begin_read add_event error\n");
-        close_connection(c);
-        return;
+    // The edge of data that arrived meanwhile has passed already
+    if (c->flags & CONNECTION_FLAG_READABLE) {
+        c->flags &= ~CONNECTION_FLAG_READABLE;
+        if (!event_base_ops(c->worker->base)) {
+            read_data(c);
+        } else if (c->flags & CONNECTION_FLAG_ERROR) {
+            c->state = CONNECTION_STATE_ERROR;
+            close_connection(c);
+        } else if (c->pending && c->pending->size) {
+            // Received already. A peer that closed after sending it still gets
+            // its response, the close is acted on by the next begin_read.
+            buffer_t *pending = c->pending;
+            c->pending = c->buffer;
+            c->buffer = pending;
+            if (c->flags & CONNECTION_FLAG_EOF)
+                c->flags |= CONNECTION_FLAG_READABLE;
+            process_request(c);
+        } else {
+            c->state = CONNECTION_STATE_CLOSED;
+            close_connection(c);
+        }
     }
 }
 
 void begin_send(struct connection *c)
 {
-    struct worker *worker = c->worker;
-
     if (reset_connection(c) != OK) {
         close_connection(c);
         return;
     }
 
     c->state = CONNECTION_STATE_OUT;
-    c->event = make_event(c->fd, EPOLLOUT|EPOLLET, io_callback, c);
-    if (add_event(worker->base, &c->event) != OK) {
-        fprintf(stderr, "Connection: connection_begin_send add_event error\n");
-        close_connection(c);
-        return;
-    }
-
     send_data(c);
 }
+
+// NOTE: The connection is left alone until the job completes, even if the
+// client goes away meanwhile: the job still refers to it.
+void begin_wait(struct connection *c)
+{
+    struct worker *worker = c->worker;
+    if (c->timer.flags & TIMER_FLAG_ACTIVE)
+        del_timer(worker->base, &c->timer);
+    c->state = CONNECTION_STATE_WAIT;
+}
@@ -5,6 +5,7 @@
 #include "event.h"
 #include "request.h"
 #include <arpa/inet.h>
+#include <sys/uio.h>
 
 typedef struct buffer_t buffer_t;
 
@@ -14,16 +15,29 @@ enum connection_state
 {
     CONNECTION_STATE_IN,
     CONNECTION_STATE_OUT,
+    // Waiting for an I/O job, with no events or timeout armed
+    CONNECTION_STATE_WAIT,
     CONNECTION_STATE_CLOSED,
     CONNECTION_STATE_ERROR
 };
 
 #define CONNECTION_FLAG_KEEPALIVE (1 << 0)
+// Data arrived while the connection wasn't reading, see begin_read
+#define CONNECTION_FLAG_READABLE (1 << 1)
+// The peer is gone, noticed while the connection wasn't reading (io_uring)
+#define CONNECTION_FLAG_EOF (1 << 2)
+// Closed, but a send still uses its memory (io_uring)
+#define CONNECTION_FLAG_CLOSING (1 << 3)
+// Receiving failed while the connection wasn't reading (io_uring)
+#define CONNECTION_FLAG_ERROR (1 << 4)
 
 struct connection
 {
     struct list node;
+    // NOTE: With io_uring, event receives everything that arrives, and out
+    // sends, or waits to be able to send a file body
     struct event event;
+    struct event out;
     struct timer timer;
     
     struct worker *worker;
@@ -35,15 +49,35 @@ struct connection
     int flags;
 
     buffer_t *buffer;
+    // Response body, sent after the contents of the buffer. Not owned by the connection.
+    // Either borrowed memory, or a range of a file sent with sendfile (body_fd >= 0).
+    const char *body;
+    int body_fd;
+    off_t body_off;
+    size_t body_len;
+    // If set, called once the body isn't needed anymore, i.e. after it has been
+    // sent or when the connection is closed.
+    void (*body_release)(void *);
+    void *body_release_data;
     size_t write_bytes;
+    // Message of the send in flight (io_uring)
+    struct msghdr msg;
+    struct iovec iov[2];
+    // Data received while the connection wasn't reading (io_uring), NULL until needed
+    buffer_t *pending;
 
     struct request req;
 };
 
+// Accepts one queued connection. Returns ERR once nothing is left to accept,
+// a connection that fails to open is dropped and still returns OK.
 int accept_connection(struct worker *worker);
+// Takes over the accepted socket, closing it on failure
+int open_connection(struct worker *worker, int fd);
 void close_connection(struct connection *c);
 int reset_connection(struct connection *c);
 void begin_read(struct connection *c);
 void begin_send(struct connection *c);
+void begin_wait(struct connection *c);
 
 #endif
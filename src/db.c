@@ -1,258 +1,2813 @@
 #include "db.h"
+#include "cache.h"
+#include "gzip.h"
+#include "uring.h"
+#include "util.h"
 #include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <errno.h>
 
 #define DBID_FREE 0xFFFFFFFFFFFFFFFF
 
 #define REC_HDR_SIZE offsetof(struct record, offset)
 
-#pragma pack(push, 1)
+// NOTE: The length word of a record keeps the codec of the value in its top
+// bits. Values were always far smaller than this, so records written before
+// compression read as uncompressed.
+#define REC_CODEC_SHIFT 28
+#define rec_codec(vlen) ((vlen) >> REC_CODEC_SHIFT)
+
+// Set in the length word of records that expire, see struct record
+#define REC_EXPIRES (1U << 27)
+// NOTE: Set in the length word of records followed by a CRC32C of their header
+// and value, which tells torn and damaged records apart from intact ones.
+// Records written before checksums have none.
+#define REC_CHECKSUM (1U << 26)
+#define REC_CRC_SIZE sizeof(uint32_t)
+#define REC_LEN_MASK (REC_CHECKSUM - 1)
+#define rec_len(vlen) ((vlen) & REC_LEN_MASK)
+// Size of the record in the file, header and checksum included
+#define rec_size(vlen) (REC_HDR_SIZE + rec_len(vlen) + (((vlen) & REC_CHECKSUM) ? REC_CRC_SIZE : 0))
+
+// Codec of alias records. Their value is a struct alias, naming the record that
+// holds the actual value. Never seen outside of the data file.
+#define REC_ALIAS 0xFU
+// NOTE: Codec of pad records, which fill the rest of the last block of a record
+// in direct mode. Their id is DBID_FREE, and their length covers the padding
+// after their header.
+#define REC_PAD 0xEU
+
+// Recently inserted values by hash, used to find duplicates. Lossy: a slot
+// just keeps the latest value that hashed to it.
+#define DEDUP_SLOTS (1 << 18)
+#define DEDUP_SEED 0x6361736b
+
+// Values smaller than this aren't worth compressing
+#define COMPRESS_MIN 128
+
+#define INDEX_SUFFIX ".idx"
+#define INDEX_MAGIC 0x35584449204b5343ULL // "CSK IDX5"
+
+// NOTE: Entries take a cache line, and values up to this size are copied into
+// the rest of it. Reading those touches neither the record nor the disk.
+#define INDEX_INLINE_MAX 40
+// Entries keep the expiry in a field of its own, so its bit in vlen marks a
+// value copied into the entry instead
+#define ENTRY_INLINE REC_EXPIRES
+
+// The index file is mapped once with room for this many entries, and grown
+// with ftruncate, so the mapping never moves.
+#define INDEX_MAX_ENTRIES (1ULL << 32)
+#define INDEX_MAP_SIZE (sizeof(struct index_header) + sizeof(struct index_entry) * INDEX_MAX_ENTRIES)
+
+// Once the index is filled past this fraction, it is grown ahead of time
+#define INDEX_GROW_LOAD(capacity) ((capacity) / 4 * 3)
+
+// NOTE: The index mapping is aligned to this with huge pages, a mapping can
+// only use them where it is
+#define HUGE_PAGE_SIZE (2ULL * 1024 * 1024)
+
+// Added in Linux 5.14, older kernels fail it with EINVAL
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+// Same for the record area. Values handed out by db_get point into this
+// mapping, and stay valid as it grows. This is also the maximum database size.
+#define DATA_MAP_SIZE (1ULL << 40)
+
+// NOTE: The record area is split into zones, which new records never straddle.
+// Each zone is stored in a segment file of its own, except for the ones in the
+// database file itself, which holds the records of databases created before
+// segments. Zones are the unit of compaction: the live records of a zone are
+// copied to the tail, and the zone is then removed.
+#define ZONE_SHIFT 26
+#define ZONE_SIZE (1ULL << ZONE_SHIFT)
+#define NUM_ZONES (DATA_MAP_SIZE >> ZONE_SHIFT)
+#define zone_of(offset) ((offset) >> ZONE_SHIFT)
+#define zone_start(zone) ((uint64_t)(zone) << ZONE_SHIFT)
+
+// Segment files are named after the database file and their zone. The manifest
+// lists them.
+#define SEGMENT_NAME "%s.%06lu"
+#define MANIFEST_SUFFIX ".manifest"
+#define MANIFEST_MAGIC 0x314e414d204b5343ULL // "CSK MAN1"
+
+// NOTE: Index snapshots are a copy of the index as of a position in the log.
+// After a crash, the index is restored from the snapshot, and only the records
+// written after that position are scanned.
+#define SNAPSHOT_SUFFIX ".snap"
+#define SNAPSHOT_MAGIC 0x31504e53204b5343ULL // "CSK SNP1"
+// Entries written per write call
+#define SNAPSHOT_BATCH 4096
+
+// Readers and writers pin the zones they use in per-thread tables, threads
+// beyond this many share them
+#define PIN_SLOTS 64
+
+// Index rebuilds scan the files in parallel, on up to this many threads. The
+// second pass hands out ids in chunks of this many.
+#define SCAN_THREADS 32
+#define SCAN_CHUNK (1 << 16)
+
+// Size of the io_uring of each thread, when the database uses io_uring
+#define RING_ENTRIES 64
+// Prefetches read values in pieces of up to this size
+#define PREFETCH_CHUNK (64 * 1024)
+
+// NOTE: In direct mode, segments are written and read with O_DIRECT, past the
+// page cache, and values are kept in a buffer pool instead. Writes have to
+// cover whole blocks of the file system, so records are padded to them.
+#define DIRECT_ALIGN_MIN 512
+#define DIRECT_ALIGN_MAX (64 * 1024)
+#define DIRECT_ALIGN_DEFAULT 4096
+// Pins of values in the buffer pool are their entries, tagged with this bit
+#define PIN_BUFFER 1U
+// Values in index entries are never moved, their pins are the entries tagged
+// with this bit, and pin nothing
+#define PIN_INLINE 2U
+
+// Zones with less live data than this are compacted
+#define COMPACT_LIVE_MIN (ZONE_SIZE / 2)
+// NOTE: Nanoseconds. How far ahead of its rate compaction may get before it
+// sleeps, and how often it checks whether a zone is still pinned.
+#define COMPACT_SLACK 1000000
 
 struct header
 {
-    dbid_t id;
+    // Next id to hand out. Inserts reserve ids from this atomically.
+    _Atomic dbid_t id;
+    // NOTE: Databases created before the dense index hashed ids into a table
+    // of this many buckets, placed right after the header. New databases have
+    // zero buckets; the field is kept so the record area can be located in both.
     size_t num_buckets;
 };
 
+#pragma pack(push, 1)
+struct record
+{
+    // Length and codec of the stored value, see REC_CODEC_SHIFT
+    uint32_t vlen;
+    dbid_t id;
+    // NOTE: Unix time the record expires at, if REC_EXPIRES is set in the
+    // length word. Databases created before the dense index chained records
+    // through this field, so records without a TTL keep DBID_FREE here.
+    dbid_t expires;
+
+    dbid_t offset;
+
+    const char *val;
+    uint32_t crc;
+};
+
+struct alias
+{
+    dbid_t offset;
+    uint32_t vlen;
+};
+
+// Index entry in a snapshot, unused if the offset is zero
+struct snapshot_entry
+{
+    dbid_t offset;
+    uint32_t vlen;
+    uint64_t expires;
+};
+#pragma pack(pop)
+
+enum zone_state
+{
+    ZONE_OPEN,
+    // Being compacted, dedup doesn't alias records in it anymore
+    ZONE_COMPACTING,
+    // Compacted, no records left
+    ZONE_PUNCHED
+};
+
+// NOTE: A zone is stored in the database file if it is below base_zones, in
+// a segment file otherwise. The segment is the tail one while records are
+// appended to it, and is sealed once the tail has moved on: synced, made
+// read-only and never written again.
+struct zone
+{
+    // -1 if the zone has no file, i.e. it wasn't used yet or was compacted
+    _Atomic int fd;
+    // enum zone_state
+    _Atomic uint8_t state;
+    // Inserts with a range reserved in the zone, that haven't published their
+    // record yet
+    _Atomic uint32_t writers;
+    // Whether the zone has a segment in the manifest, and whether it is sealed.
+    // Protected by the segment lock.
+    bool listed;
+    bool sealed;
+};
+
+struct manifest_header
+{
+    uint64_t magic;
+    // Zones stored in the database file
+    uint64_t base_zones;
+    uint64_t num_segments;
+};
+
+struct manifest_segment
+{
+    uint64_t zone;
+    uint64_t sealed;
+};
+
+struct snapshot_header
+{
+    uint64_t magic;
+    // Log position the snapshot covers, i.e. every record before it is indexed
+    uint64_t position;
+    // Number of entries, the next id when the snapshot was taken
+    uint64_t count;
+    // See struct db
+    uint64_t zoned_from;
+};
+
+struct dedup_slot
+{
+    _Atomic uint64_t hash;
+    _Atomic dbid_t id;
+};
+
+// An insert waiting for group commit
+struct pending
+{
+    struct pending *next;
+    struct record rec;
+    int status;
+    bool done;
+};
+
+// NOTE: With durability enabled, inserts queue up here. Whoever finds no
+// leader becomes one, and writes and syncs everything queued so far as one
+// batch, while new inserts queue up for the next. Ids are assigned per batch,
+// so batches are written in order.
+struct commit
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pending *head;
+    struct pending **tail;
+    bool leader;
+    size_t last_batch;
+};
+
 struct db
 {
+    // The database file, holding the header
     int fd;
+    char *path;
+
+    struct header *meta;
+    void *map;
+    const uint8_t *data;
+
+    int idxfd;
+    struct index_header *idx;
+    struct index_entry *entries;
+    // Number of usable index entries. Readers check against this before
+    // touching an entry, so it is only raised once the file has been grown.
+    _Atomic uint64_t capacity;
+
+    // NOTE: The fields below are written by every insert. They live on their
+    // own cache line, so that the read path never shares one with them.
+
+    // End of the record area. New records are appended here.
+    _Alignas(64) _Atomic uint64_t tail;
+
+    // Serializes index growth. Inserts reserve their id and file range
+    // atomically and write their records in parallel, readers take no locks.
+    pthread_mutex_t grow_lock;
+
+    enum db_durability durability;
+    uint32_t commit_window;
+    // zlib compression level for new values, 0 stores them uncompressed
+    int compression;
+    // Values up to this size are copied into their index entries
+    uint32_t inline_max;
+
+    // NULL unless deduplication is enabled
+    struct dedup_slot *dedup;
+    _Atomic uint64_t dedup_hits;
+    struct commit commit;
+
+    // Pin counts per zone, one table per thread, allocated on first use
+    _Atomic(_Atomic uint32_t *) pins[PIN_SLOTS];
+    struct zone *zones;
+    // Zones stored in the database file, see struct zone
+    uint64_t base_zones;
+    // Zones before this one hold records written before zones existed, which
+    // may straddle them, and are never compacted
+    uint64_t zoned_from;
+    // Serializes segment creation, sealing and removal, and manifest updates
+    pthread_mutex_t segment_lock;
+    // One past the highest zone with a segment, and the first zone that may
+    // have a segment that isn't sealed yet
+    uint64_t segments_end;
+    uint64_t sealed_until;
+
+    // Background sealing and compaction, see background_main
+    pthread_t background;
+    bool background_started;
+    pthread_mutex_t background_lock;
+    pthread_cond_t background_cond;
+    bool segment_started;
+    bool stopping;
+    uint32_t compact_interval;
+    uint64_t compact_rate;
+    uint32_t snapshot_interval;
+    // Position of the last snapshot taken
+    uint64_t snapshot_position;
+    _Atomic uint64_t expired;
+    _Atomic uint64_t reclaimed;
+
+    // Whether I/O goes through io_uring. Each thread gets its own ring on
+    // first use, kept under ring_key.
+    bool uring;
+    pthread_key_t ring_key;
+
+    // Direct mode: the block size records are aligned to, and the buffer pool
+    // of values, keyed by their record's position. Zero and NULL otherwise.
+    uint32_t align;
+    struct cache *pool;
+};
+
+// Pin table slot of the calling thread
+static _Thread_local int pin_slot = -1;
+static _Atomic int next_pin_slot;
+
+
+// Dense id -> record mapping, stored in a separate file next to the database.
+// An entry with a zero offset is unused (offset zero is always the header).
+struct index_header
+{
+    uint64_t magic;
+    uint64_t capacity;
+    // Set when the database was closed cleanly, and the index was synced.
+    // Otherwise the index may be missing entries, and is rebuilt on open.
+    uint64_t clean;
+    // See struct db, recovered when the index is rebuilt
+    uint64_t zoned_from;
+    // Entries start on a cache line of their own
+    uint64_t reserved[4];
+};
+
+// NOTE: Entries are seqlocks. The sequence is odd while an entry is being
+// written, and readers retry until they see the same even sequence before
+// and after reading the fields.
+struct index_entry
+{
+    _Alignas(64) _Atomic uint32_t seq;
+    _Atomic uint32_t vlen;
+    _Atomic dbid_t offset;
+    // Unix time the entry expires at, zero if it doesn't
+    _Atomic uint64_t expires;
+    // NOTE: Copy of the value if vlen has ENTRY_INLINE set. Written once per
+    // id, while the entry is unused. Moving the record leaves it as it is.
+    uint8_t data[INDEX_INLINE_MAX];
+};
+
+static inline uint64_t get_file_size(int fd)
+{
+    struct stat fs;
+    if (fstat(fd, &fs) < 0) return 0;
+    return (uint64_t)fs.st_size;
+}
+
+static inline uint64_t data_start(const struct header *meta)
+{
+    return sizeof(struct header) + sizeof(dbid_t) * meta->num_buckets;
+}
+
+static inline uint64_t unix_time(void)
+{
+    return get_time() / 1000000000ULL;
+}
+
+static inline bool is_expired(uint64_t expires, uint64_t now)
+{
+    return expires && expires <= now;
+}
+
+static inline size_t index_size(uint64_t capacity)
+{
+    return sizeof(struct index_header) + sizeof(struct index_entry) * capacity;
+}
+
+// Position of the offset in the file of its zone
+static inline uint64_t file_offset(const struct db *db, uint64_t offset)
+{
+    return (zone_of(offset) < db->base_zones) ? offset : offset - zone_start(zone_of(offset));
+}
+
+static inline int zone_fd(struct db *db, uint64_t zone)
+{
+    return atomic_load_explicit(&db->zones[zone].fd, memory_order_acquire);
+}
+
+// Sets the checksum of the record, once its header is final
+static inline void checksum_record(struct record *rec)
+{
+    uint32_t crc = crc32c(0, rec, REC_HDR_SIZE);
+    rec->crc = crc32c(crc, rec->val, rec_len(rec->vlen));
+}
+
+// Whether the record at p, with the given length word, is the one written
+static inline bool record_intact(const uint8_t *p, uint32_t vlen)
+{
+    if (!(vlen & REC_CHECKSUM))
+        return true;
+    uint32_t crc;
+    memcpy(&crc, p + REC_HDR_SIZE + rec_len(vlen), sizeof crc); // NOLINT [C11 Annex K]
+    return crc32c(0, p, REC_HDR_SIZE + rec_len(vlen)) == crc;
+}
+
+// Fills the iovecs for writing the record, returns how many it used
+static inline int record_iov(const struct record *rec, struct iovec *iov)
+{
+    iov[0].iov_base = (void *)(uintptr_t)rec;
+    iov[0].iov_len = REC_HDR_SIZE;
+    iov[1].iov_base = (void *)(uintptr_t)rec->val;
+    iov[1].iov_len = rec_len(rec->vlen);
+    if (!(rec->vlen & REC_CHECKSUM))
+        return 2;
+    iov[2].iov_base = (void *)(uintptr_t)&rec->crc;
+    iov[2].iov_len = REC_CRC_SIZE;
+    return 3;
+}
+
+// Size a record takes up in the file, including its pad record in direct mode.
+// The padding is never shorter than the header of the pad record.
+static inline uint64_t slot_size(const struct db *db, uint32_t vlen)
+{
+    uint64_t size = rec_size(vlen);
+    if (!db->align)
+        return size;
+    uint64_t padded = (size + db->align - 1) & ~((uint64_t)db->align - 1);
+    if (padded != size && padded - size < REC_HDR_SIZE)
+        padded += db->align;
+    return padded;
+}
+
+// Copies the record, followed by its pad record, to dst. Returns the size of both.
+static uint64_t pack_record(const struct db *db, const struct record *rec, char *dst)
+{
+    struct iovec iov[3];
+    int iovcnt = record_iov(rec, iov);
+    char *p = dst;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len); // NOLINT [C11 Annex K]
+        p += iov[i].iov_len;
+    }
+
+    uint64_t size = slot_size(db, rec->vlen);
+    uint64_t pad = size - (uint64_t)(p - dst);
+    if (pad) {
+        struct record hdr = {0};
+        hdr.vlen = (uint32_t)(pad - REC_HDR_SIZE) | (REC_PAD << REC_CODEC_SHIFT);
+        hdr.id = DBID_FREE;
+        hdr.expires = DBID_FREE;
+        memcpy(p, &hdr, REC_HDR_SIZE); // NOLINT [C11 Annex K]
+        memset(p + REC_HDR_SIZE, 0, pad - REC_HDR_SIZE); // NOLINT [C11 Annex K]
+    }
+    return size;
+}
+
+static void destroy_ring(void *ring)
+{
+    destroy_uring(ring);
+}
+
+// Ring of the calling thread, NULL if the database doesn't use io_uring, or
+// the thread can't have one
+static struct uring *thread_ring(struct db *db)
+{
+    if (!db->uring)
+        return NULL;
+    struct uring *ring = pthread_getspecific(db->ring_key);
+    if (!ring) {
+        ring = create_uring(RING_ENTRIES);
+        if (ring && pthread_setspecific(db->ring_key, ring)) {
+            destroy_uring(ring);
+            ring = NULL;
+        }
+    }
+    return ring;
+}
+
+// NOTE: Writes and syncs go through the ring of the thread, if it has one,
+// and are plain system calls otherwise. On the ring, they run in the order
+// they were queued: linked to each other while queued together, and draining
+// the ring when queued behind ones already submitted. Each is tagged with the
+// result it should have, e.g. the size of a write, anything else fails the
+// batch.
+struct write_batch
+{
+    struct uring *ring;
+    // Last entry queued and not submitted yet
+    struct io_uring_sqe *last;
+    int ret;
+};
+
+static inline struct write_batch start_writes(struct db *db)
+{
+    return (struct write_batch){thread_ring(db), NULL, OK};
+}
+
+// Hands the queued entries to the kernel, whatever they point to may be reused
+static void submit_writes(struct write_batch *b)
+{
+    if (!b->ring)
+        return;
+    if (uring_submit(b->ring, false) != OK)
+        b->ret = ERR;
+    b->last = NULL;
+}
+
+// Waits for everything queued, returns whether all of it succeeded
+static int finish_writes(struct write_batch *b)
+{
+    if (!b->ring)
+        return b->ret;
+    if (uring_submit(b->ring, true) != OK)
+        b->ret = ERR;
+    b->last = NULL;
+
+    uint64_t result;
+    int32_t res;
+    while (uring_complete(b->ring, &result, &res)) {
+        if (res < 0 || (uint64_t)res != result)
+            b->ret = ERR;
+    }
+    return b->ret;
+}
+
+static struct io_uring_sqe *queue_write(struct write_batch *b, uint8_t opcode, int fd, const void *addr,
+                                        uint32_t len, uint64_t offset, uint64_t result)
+{
+    struct io_uring_sqe *sqe = (uring_inflight(b->ring) < RING_ENTRIES) ? uring_sqe(b->ring) : NULL;
+    if (!sqe) {
+        // Full, finish what's queued first, which keeps the order
+        finish_writes(b);
+        sqe = uring_sqe(b->ring);
+    }
+    uring_prep(sqe, opcode, fd, addr, len, offset, result);
+    if (b->last)
+        b->last->flags |= IOSQE_IO_LINK;
+    else if (uring_inflight(b->ring))
+        sqe->flags |= IOSQE_IO_DRAIN;
+    b->last = sqe;
+    return sqe;
+}
+
+static void write_iov(struct db *db, struct write_batch *b, uint64_t pos, const struct iovec *iov,
+                      int iovcnt, uint64_t size)
+{
+    int fd = zone_fd(db, zone_of(pos));
+    uint64_t offset = file_offset(db, pos);
+    if (b->ring)
+        queue_write(b, IORING_OP_WRITEV, fd, iov, (uint32_t)iovcnt, offset, size);
+    else if (pwritev(fd, iov, iovcnt, (off_t)offset) != (ssize_t)size)
+        b->ret = ERR;
+}
+
+// Syncs the files of the zones from first to last
+static void sync_zones(struct db *db, struct write_batch *b, uint64_t first, uint64_t last)
+{
+    for (uint64_t zone = first; zone <= last; zone++) {
+        int fd = zone_fd(db, zone);
+        if (fd < 0)
+            continue;
+        if (b->ring) {
+            struct io_uring_sqe *sqe = queue_write(b, IORING_OP_FSYNC, fd, NULL, 0, 0, 0);
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        } else if (fdatasync(fd) < 0) {
+            b->ret = ERR;
+        }
+    }
+}
+
+// NOTE: The record must have a range of slot_size reserved. In direct mode, it
+// is written from an aligned copy, along with its pad record.
+static inline int write_record(struct db *db, const struct record *rec)
+{
+    struct iovec iov[3];
+    int iovcnt;
+    uint64_t size = slot_size(db, rec->vlen);
+    char *packed = NULL;
+    if (db->align) {
+        packed = aligned_alloc(db->align, size);
+        if (!packed)
+            return ERR;
+        pack_record(db, rec, packed);
+        iov[0].iov_base = packed;
+        iov[0].iov_len = size;
+        iovcnt = 1;
+    } else {
+        iovcnt = record_iov(rec, iov);
+    }
+
+    struct write_batch writes = start_writes(db);
+    write_iov(db, &writes, rec->offset, iov, iovcnt, size);
+    int ret = finish_writes(&writes);
+    free(packed);
+    return ret;
+}
+
+// NOTE: Called with the grow lock held. As the index is dense and the mapping
+// never moves, growing it doesn't touch existing entries: readers and writers
+// carry on while it happens.
+static int grow_index(struct db *db, uint64_t capacity)
+{
+    uint64_t old = atomic_load_explicit(&db->capacity, memory_order_relaxed);
+    if (capacity > INDEX_MAX_ENTRIES)
+        capacity = INDEX_MAX_ENTRIES;
+    if (capacity <= old)
+        return (capacity == old) ? OK : ERR;
+
+    // Allocate the new range up front, so that writing to a new entry can't
+    // fault on a full disk. Not all filesystems support this, though.
+    off_t start = (off_t)index_size(old);
+    off_t len = (off_t)index_size(capacity) - start;
+    if (fallocate(db->idxfd, 0, start, len) < 0) {
+        if (ftruncate(db->idxfd, (off_t)index_size(capacity)) < 0)
+            return ERR;
+    }
+    db->idx->capacity = capacity;
+    atomic_store_explicit(&db->capacity, capacity, memory_order_release);
+    return OK;
+}
+
+// Makes sure the index has room for the id. Concurrent inserts may race here,
+// whoever gets the lock first grows the index for everyone.
+static int reserve_index(struct db *db, dbid_t id)
+{
+    int ret = OK;
+    if (pthread_mutex_lock(&db->grow_lock))
+        return ERR;
+    uint64_t capacity = atomic_load_explicit(&db->capacity, memory_order_relaxed);
+    if (id >= capacity) {
+        while (capacity <= id)
+            capacity *= 2;
+        ret = grow_index(db, capacity);
+    }
+    pthread_mutex_unlock(&db->grow_lock);
+    return ret;
+}
+
+// Grows the index once it is filled past the load threshold, so that inserts
+// rarely find it full and have to wait in reserve_index. Whoever crosses the
+// threshold grows it, other inserts don't wait for that.
+static inline void grow_index_ahead(struct db *db, dbid_t id)
+{
+    uint64_t capacity = atomic_load_explicit(&db->capacity, memory_order_relaxed);
+    if (id < INDEX_GROW_LOAD(capacity) || capacity == INDEX_MAX_ENTRIES)
+        return;
+    if (pthread_mutex_trylock(&db->grow_lock))
+        return;
+    capacity = atomic_load_explicit(&db->capacity, memory_order_relaxed);
+    if (id >= INDEX_GROW_LOAD(capacity))
+        grow_index(db, capacity * 2);
+    pthread_mutex_unlock(&db->grow_lock);
+}
+
+// NOTE: There is only ever one writer per entry at a time: the insert that
+// reserved its id, and after that the compactor. If val is set, the value is
+// copied into the entry when it is small enough, otherwise vlen says whether
+// the entry keeps the copy it has.
+static inline void publish_entry(struct db *db, dbid_t id, uint64_t offset, uint32_t vlen, uint64_t expires,
+                                 const void *val)
+{
+    struct index_entry *e = &db->entries[id];
+    uint32_t seq = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    atomic_store_explicit(&e->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if (val) {
+        vlen &= ~ENTRY_INLINE;
+        if (rec_len(vlen) <= db->inline_max) {
+            memcpy(e->data, val, rec_len(vlen)); // NOLINT [C11 Annex K]
+            vlen |= ENTRY_INLINE;
+        }
+    }
+    atomic_store_explicit(&e->vlen, vlen, memory_order_relaxed);
+    atomic_store_explicit(&e->offset, offset, memory_order_relaxed);
+    atomic_store_explicit(&e->expires, expires, memory_order_relaxed);
+    atomic_store_explicit(&e->seq, seq + 2, memory_order_release);
+}
+
+static inline uint64_t record_expiry(const struct record *rec)
+{
+    return (rec->vlen & REC_EXPIRES) ? rec->expires : 0;
+}
+
+// Points the id at the value of the record, or at the value an alias names
+static inline void publish_record(struct db *db, const struct record *rec)
+{
+    if (rec_codec(rec->vlen) == REC_ALIAS) {
+        const struct alias *alias = (const struct alias *)(const void *)rec->val;
+        publish_entry(db, rec->id, alias->offset, alias->vlen, record_expiry(rec),
+                      db->data + alias->offset + REC_HDR_SIZE);
+    } else {
+        publish_entry(db, rec->id, rec->offset, rec->vlen & ~REC_EXPIRES, record_expiry(rec), rec->val);
+    }
+}
+
+// Returns the sequence the fields were read at
+static inline uint32_t read_entry(const struct index_entry *e, uint64_t *offset, uint32_t *vlen, uint64_t *expires)
+{
+    uint32_t seq;
+    do {
+        seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        *offset = atomic_load_explicit(&e->offset, memory_order_relaxed);
+        *vlen = atomic_load_explicit(&e->vlen, memory_order_relaxed);
+        *expires = atomic_load_explicit(&e->expires, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&e->seq, memory_order_relaxed));
+    return seq;
+}
+
+static _Atomic uint32_t *pin_table(struct db *db)
+{
+    if (pin_slot < 0)
+        pin_slot = atomic_fetch_add_explicit(&next_pin_slot, 1, memory_order_relaxed) % PIN_SLOTS;
+
+    _Atomic uint32_t *pins = atomic_load_explicit(&db->pins[pin_slot], memory_order_acquire);
+    if (pins)
+        return pins;
+    _Atomic uint32_t *table = calloc(NUM_ZONES, sizeof *table);
+    if (!table)
+        return NULL;
+    // Threads sharing the slot may race to set it up
+    if (!atomic_compare_exchange_strong_explicit(&db->pins[pin_slot], &pins, table,
+                                                 memory_order_seq_cst, memory_order_acquire)) {
+        free(table);
+        return pins;
+    }
+    return table;
+}
+
+// NOTE: Looks up the entry and pins the zone its record is in. Compaction
+// leaves a pinned zone in place until it is unpinned with db_release, so the
+// record stays readable even if it is moved meanwhile. A value copied into
+// the entry needs no pin, the entry tagged with PIN_INLINE is returned. Returns
+// NULL if the entry is unused or expired.
+static void *pin_entry(struct db *db, dbid_t id, uint64_t *offset, uint32_t *vlen, uint64_t *expires)
+{
+    if (id >= atomic_load_explicit(&db->capacity, memory_order_acquire))
+        return NULL;
+    _Atomic uint32_t *pins = pin_table(db);
+    if (!pins)
+        return NULL;
+
+    struct index_entry *e = &db->entries[id];
+    while (1) {
+        uint32_t seq = read_entry(e, offset, vlen, expires);
+        if (*offset == 0 || (*expires && *expires <= unix_time()))
+            return NULL;
+        if (*vlen & ENTRY_INLINE)
+            return (void *)((uintptr_t)e | PIN_INLINE);
+
+        // The compactor moves the entry before it checks the pins, and we pin
+        // before checking that the entry didn't move. Either it sees the pin,
+        // or we see the move and try again at the new location.
+        _Atomic uint32_t *pin = &pins[zone_of(*offset)];
+        atomic_fetch_add_explicit(pin, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&e->seq, memory_order_seq_cst) == seq)
+            return pin;
+        atomic_fetch_sub_explicit(pin, 1, memory_order_release);
+    }
+}
+
+// Number of readers that have the zone pinned
+static uint64_t zone_pins(struct db *db, uint64_t zone)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < PIN_SLOTS; i++) {
+        _Atomic uint32_t *pins = atomic_load_explicit(&db->pins[i], memory_order_seq_cst);
+        if (pins)
+            count += atomic_load_explicit(&pins[zone], memory_order_seq_cst);
+    }
+    return count;
+}
+
+// Returns the path with the suffix appended, to be freed by the caller
+static char *path_with(const char *path, const char *suffix)
+{
+    size_t len = strlen(path);
+    size_t slen = strlen(suffix);
+    char *result = malloc(len + slen + 1);
+    if (!result) return NULL;
+    memcpy(result, path, len); // NOLINT [C11 Annex K]
+    memcpy(result + len, suffix, slen + 1); // NOLINT [C11 Annex K]
+    return result;
+}
+
+static char *segment_path(const struct db *db, uint64_t zone)
+{
+    size_t len = strlen(db->path) + 32;
+    char *path = malloc(len);
+    if (!path) return NULL;
+    snprintf(path, len, SEGMENT_NAME, db->path, zone); // NOLINT [C11 Annex K]
+    return path;
+}
+
+static inline int map_zone(struct db *db, uint64_t zone, int fd)
+{
+    void *addr = (void *)(uintptr_t)(db->data + zone_start(zone));
+    if (mmap(addr, ZONE_SIZE, PROT_READ, MAP_SHARED|MAP_FIXED|MAP_NORESERVE, fd, 0) == MAP_FAILED)
+        return ERR;
+    return OK;
+}
+
+// Puts the reservation back in place of the zone's segment
+static inline void unmap_zone(struct db *db, uint64_t zone)
+{
+    void *addr = (void *)(uintptr_t)(db->data + zone_start(zone));
+    mmap(addr, ZONE_SIZE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE, -1, 0);
+}
+
+// NOTE: Writes the list of segments to a temporary file, and renames it over
+// the manifest, so that the manifest on disk is always complete. Called with
+// the segment lock held.
+static int write_manifest(struct db *db)
+{
+    int ret = ERR;
+    char *path = path_with(db->path, MANIFEST_SUFFIX);
+    char *tmp = path_with(db->path, MANIFEST_SUFFIX ".tmp");
+    struct manifest_segment *segments = NULL;
+    int fd = -1;
+    if (!path || !tmp)
+        goto out;
+
+    struct manifest_header header = {0};
+    header.magic = MANIFEST_MAGIC;
+    header.base_zones = db->base_zones;
+    segments = malloc((db->segments_end - db->base_zones + 1) * sizeof *segments);
+    if (!segments)
+        goto out;
+    for (uint64_t zone = db->base_zones; zone < db->segments_end; zone++) {
+        if (!db->zones[zone].listed)
+            continue;
+        segments[header.num_segments].zone = zone;
+        segments[header.num_segments++].sealed = db->zones[zone].sealed;
+    }
+
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd < 0)
+        goto out;
+    ssize_t size = (ssize_t)(header.num_segments * sizeof *segments);
+    if (write(fd, &header, sizeof header) != sizeof header ||
+        write(fd, segments, (size_t)size) != size ||
+        fdatasync(fd) < 0 || rename(tmp, path) < 0)
+        goto out;
+    ret = OK;
+
+out:
+    if (ret != OK)
+        perror("DB: Failed to write the manifest");
+    if (fd >= 0)
+        close(fd);
+    free(segments);
+    free(tmp);
+    free(path);
+    return ret;
+}
+
+// Creates the segment of the zone. Called with the segment lock held.
+static int create_segment(struct db *db, uint64_t zone)
+{
+    char *path = segment_path(db, zone);
+    if (!path)
+        return -1;
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC|(db->align ? O_DIRECT : 0), S_IRUSR|S_IWUSR);
+    if (fd < 0 || map_zone(db, zone, fd) != OK) {
+        perror("DB: Failed to create a segment");
+        if (fd >= 0)
+            close(fd);
+        free(path);
+        return -1;
+    }
+
+    uint64_t segments_end = db->segments_end;
+    db->zones[zone].listed = true;
+    if (zone >= db->segments_end)
+        db->segments_end = zone + 1;
+    // Only used once the manifest has it, a segment missing from it would be
+    // lost on the next open
+    if (write_manifest(db) != OK) {
+        db->zones[zone].listed = false;
+        db->segments_end = segments_end;
+        unmap_zone(db, zone);
+        close(fd);
+        unlink(path);
+        free(path);
+        return -1;
+    }
+    free(path);
+    atomic_store_explicit(&db->zones[zone].fd, fd, memory_order_release);
+
+    // The previous segment can be sealed now
+    pthread_mutex_lock(&db->background_lock);
+    db->segment_started = true;
+    pthread_cond_broadcast(&db->background_cond);
+    pthread_mutex_unlock(&db->background_lock);
+    return fd;
+}
+
+// Returns the file of the zone, creating its segment if it doesn't have one yet
+static int get_segment(struct db *db, uint64_t zone)
+{
+    int fd = zone_fd(db, zone);
+    if (fd >= 0)
+        return fd;
+    pthread_mutex_lock(&db->segment_lock);
+    fd = zone_fd(db, zone);
+    if (fd < 0)
+        fd = create_segment(db, zone);
+    pthread_mutex_unlock(&db->segment_lock);
+    return fd;
+}
+
+// NOTE: Reserves a file range of the given size at the tail. Records never
+// straddle zones, one that doesn't fit in the current zone starts the next,
+// and the rest of the zone is left unused. The caller writes the range and
+// then calls end_write, the segment isn't sealed until then.
+static int reserve_range(struct db *db, uint64_t size, uint64_t *offset)
+{
+    uint64_t tail = atomic_load_explicit(&db->tail, memory_order_relaxed);
+    while (1) {
+        uint64_t pos = tail;
+        if (zone_of(pos) != zone_of(pos + size - 1))
+            pos = zone_start(zone_of(pos) + 1);
+        if (pos + size > DATA_MAP_SIZE)
+            return ERR;
+
+        // Counted as a writer before taking the range: once the tail has moved
+        // past the zone, nobody can start writing to it anymore
+        struct zone *zone = &db->zones[zone_of(pos)];
+        atomic_fetch_add_explicit(&zone->writers, 1, memory_order_seq_cst);
+        if (atomic_compare_exchange_weak_explicit(&db->tail, &tail, pos + size,
+                                                  memory_order_seq_cst, memory_order_relaxed)) {
+            if (get_segment(db, zone_of(pos)) < 0) {
+                atomic_fetch_sub_explicit(&zone->writers, 1, memory_order_release);
+                return ERR;
+            }
+            *offset = pos;
+            return OK;
+        }
+        atomic_fetch_sub_explicit(&zone->writers, 1, memory_order_release);
+    }
+}
+
+// Once the record is published, so that a zone without writers has all of its
+// records in the index
+static inline void end_write(struct db *db, uint64_t offset)
+{
+    atomic_fetch_sub_explicit(&db->zones[zone_of(offset)].writers, 1, memory_order_release);
+}
+
+// NOTE: Opens the segments listed in the manifest. Databases without one are
+// either new, or were created before segments: their records stay in the
+// database file, and are followed by segments from the next zone on.
+static int open_segments(struct db *db)
+{
+    for (uint64_t zone = 0; zone < NUM_ZONES; zone++)
+        atomic_init(&db->zones[zone].fd, -1);
+
+    char *path = path_with(db->path, MANIFEST_SUFFIX);
+    if (!path)
+        return ERR;
+    int fd = open(path, O_RDONLY);
+    free(path);
+
+    int ret = ERR;
+    struct manifest_header header = {0};
+    struct manifest_segment *segments = NULL;
+    if (fd < 0) {
+        uint64_t size = get_file_size(db->fd);
+        header.base_zones = zone_of(size - 1) + 1;
+    } else {
+        if (read(fd, &header, sizeof header) != sizeof header || header.magic != MANIFEST_MAGIC ||
+            header.base_zones == 0 || header.base_zones > NUM_ZONES || header.num_segments > NUM_ZONES) {
+            fprintf(stderr, "DB: Invalid manifest\n");
+            goto out;
+        }
+        ssize_t size = (ssize_t)(header.num_segments * sizeof *segments);
+        segments = malloc((size_t)size + 1);
+        if (!segments || read(fd, segments, (size_t)size) != size)
+            goto out;
+    }
+
+    db->base_zones = header.base_zones;
+    db->segments_end = db->base_zones;
+    void *addr = (void *)(uintptr_t)db->data;
+    if (mmap(addr, zone_start(db->base_zones), PROT_READ, MAP_SHARED|MAP_FIXED|MAP_NORESERVE, db->fd, 0) == MAP_FAILED)
+        goto out;
+    for (uint64_t zone = 0; zone < db->base_zones; zone++)
+        atomic_init(&db->zones[zone].fd, db->fd);
+
+    for (uint64_t i = 0; i < header.num_segments; i++) {
+        uint64_t zone = segments[i].zone;
+        if (zone < db->base_zones || zone >= NUM_ZONES) {
+            fprintf(stderr, "DB: Invalid manifest\n");
+            goto out;
+        }
+        char *segpath = segment_path(db, zone);
+        if (!segpath)
+            goto out;
+        // Sealed segments are never written again
+        int segfd = open(segpath, (segments[i].sealed ? O_RDONLY : O_RDWR) | (db->align ? O_DIRECT : 0));
+        free(segpath);
+        if (segfd < 0) {
+            perror("DB: Failed to open a segment");
+            goto out;
+        }
+        if (map_zone(db, zone, segfd) != OK) {
+            close(segfd);
+            goto out;
+        }
+        atomic_init(&db->zones[zone].fd, segfd);
+        db->zones[zone].listed = true;
+        db->zones[zone].sealed = segments[i].sealed;
+        if (zone >= db->segments_end)
+            db->segments_end = zone + 1;
+    }
+
+    // Appends continue at the end of the last segment, or start a new one.
+    // The last segment may have been sealed before the next one was listed.
+    uint64_t tail = zone_start(db->base_zones);
+    if (db->segments_end > db->base_zones) {
+        uint64_t last = db->segments_end - 1;
+        tail = zone_start(last) + get_file_size(zone_fd(db, last));
+        if (db->zones[last].sealed)
+            tail = zone_start(last + 1);
+    }
+    atomic_store_explicit(&db->tail, tail, memory_order_relaxed);
+
+    db->sealed_until = db->base_zones;
+    while (db->sealed_until < db->segments_end &&
+           (zone_fd(db, db->sealed_until) < 0 || db->zones[db->sealed_until].sealed))
+        db->sealed_until++;
+
+    ret = OK;
+    if (fd < 0) {
+        pthread_mutex_lock(&db->segment_lock);
+        ret = write_manifest(db);
+        pthread_mutex_unlock(&db->segment_lock);
+    }
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(segments);
+    return ret;
+}
+
+// A file to scan when rebuilding the index: the records in [start, end)
+struct scan_file
+{
+    uint64_t start;
+    uint64_t end;
+    // Results: where the scan stopped, the records found, one past their highest id
+    uint64_t last;
+    uint64_t count;
+    dbid_t next_id;
+    int ret;
+};
+
+struct scan
+{
+    struct db *db;
+    // Records before this are indexed already
+    uint64_t from;
+    struct scan_file *files;
+    size_t num_files;
+    _Atomic size_t next_file;
+    // Second pass, see index_entries
+    dbid_t num_ids;
+    _Atomic dbid_t next_id;
+};
+
+// Claims the entry for the record at the offset, unless a later record of the
+// id has already claimed it. The last record written for an id is the one
+// that counts, whatever order the files are scanned in.
+static inline void claim_entry(struct db *db, dbid_t id, uint64_t offset)
+{
+    _Atomic dbid_t *claim = &db->entries[id].offset;
+    uint64_t cur = atomic_load_explicit(claim, memory_order_relaxed);
+    while (cur < offset && !atomic_compare_exchange_weak_explicit(claim, &cur, offset,
+                                                                   memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+// Whether an intact record starts at the offset. Only records with a checksum
+// can tell, so older ones are never found this way.
+static inline bool record_at(const struct db *db, uint64_t offset, uint64_t end)
+{
+    if (offset + REC_HDR_SIZE > end)
+        return false;
+    struct record rec;
+    memcpy(&rec, db->data + offset, REC_HDR_SIZE); // NOLINT [C11 Annex K]
+    return (rec.vlen & REC_CHECKSUM) && rec_len(rec.vlen) && rec_codec(rec.vlen) != REC_PAD &&
+           rec.id < INDEX_MAX_ENTRIES && offset + rec_size(rec.vlen) <= end &&
+           record_intact(db->data + offset, rec.vlen);
+}
+
+// Finds the first intact record after the damaged one at the offset, which
+// claims to end at rec_end. Zoned records never straddle zones, so if there is
+// none in the zone, scanning goes on from the start of the next one.
+static uint64_t next_record(const struct db *db, uint64_t offset, uint64_t rec_end, uint64_t end)
+{
+    uint64_t limit = zone_start(zone_of(offset) + 1);
+    if (limit > end)
+        limit = end;
+
+    // A torn record usually has its header, so look where it says it ends
+    // first. That avoids mistaking a record stored inside its value for one.
+    if (rec_end > offset && record_at(db, rec_end, end))
+        return rec_end;
+
+    // Records are only aligned in direct mode, so every byte is tried
+    offset++;
+    while (offset + REC_HDR_SIZE <= limit) {
+        // A header has a non-zero length word, so none starts in the first 5
+        // bytes of a zero word. Unwritten ranges are skipped quickly that way.
+        uint64_t word;
+        memcpy(&word, db->data + offset, sizeof word); // NOLINT [C11 Annex K]
+        if (word == 0) {
+            offset += sizeof word - sizeof(uint32_t) + 1;
+            continue;
+        }
+        if (record_at(db, offset, end))
+            return offset;
+        offset++;
+    }
+    return limit;
+}
+
+// Claims entries for the records of the file, reading them through the
+// mapping. Sets file->last to the end of the last intact record.
+static void scan_records(struct db *db, struct scan_file *file)
+{
+    uint64_t offset = file->start;
+    uint64_t end = file->end;
+    uint64_t last = offset;
+    file->ret = OK;
+    while (offset + REC_HDR_SIZE <= end) {
+        struct record rec;
+        memcpy(&rec, db->data + offset, REC_HDR_SIZE); // NOLINT [C11 Annex K]
+
+        uint32_t len = rec_len(rec.vlen);
+        uint64_t rec_end = offset + rec_size(rec.vlen);
+        if (rec_codec(rec.vlen) == REC_PAD && rec.id == DBID_FREE) {
+            if (offset + REC_HDR_SIZE + len > end)
+                goto damaged;
+            offset += REC_HDR_SIZE + len;
+            last = offset;
+            continue;
+        }
+        // Values are never empty, so a zeroed header is a range that was
+        // reserved, but not written (yet): the end of a zone, a compacted zone,
+        // or the range of an insert that was still writing at the time of a
+        // crash. The latter may be followed by records that were written, and
+        // so are handled like damaged records.
+        if (rec_end > end || len == 0 || rec.id >= INDEX_MAX_ENTRIES)
+            goto damaged;
+        if (!record_intact(db->data + offset, rec.vlen)) {
+            fprintf(stderr, "DB: Checksum mismatch at offset %lu, skipping the record\n", offset);
+            goto damaged;
+        }
+        if (rec_codec(rec.vlen) == REC_ALIAS) {
+            struct alias alias;
+            if (len != sizeof alias)
+                goto damaged;
+            memcpy(&alias, db->data + offset + REC_HDR_SIZE, sizeof alias); // NOLINT [C11 Annex K]
+            // Aliases only ever name records written before them
+            if (alias.offset >= offset)
+                goto damaged;
+        }
+
+        if (rec.id >= atomic_load_explicit(&db->capacity, memory_order_acquire)) {
+            if (reserve_index(db, rec.id) != OK) {
+                file->ret = ERR;
+                break;
+            }
+        }
+        claim_entry(db, rec.id, offset);
+        if (rec.id >= file->next_id)
+            file->next_id = rec.id + 1;
+
+        // Only records written before zones existed straddle them, and those
+        // are all in the database file, which is scanned as a whole
+        if (zone_of(offset) != zone_of(rec_end - 1))
+            db->zoned_from = zone_of(rec_end - 1) + 1;
+        offset = rec_end;
+        last = offset;
+        file->count++;
+        continue;
+
+    damaged:
+        // NOTE: Inserts write their records in parallel, so records after a
+        // damaged or unwritten range may have been acknowledged. The records
+        // only end where no intact one follows.
+        offset = next_record(db, offset, rec_end, end);
+    }
+    file->last = last;
+}
+
+// Turns the entries in the chunk claimed by the scan into the actual ones,
+// resolving aliases. The others are left as they are.
+static void index_entries(struct db *db, uint64_t scanned, dbid_t from, dbid_t to)
+{
+    for (dbid_t id = from; id < to; id++) {
+        uint64_t offset = atomic_load_explicit(&db->entries[id].offset, memory_order_relaxed);
+        if (offset < scanned)
+            continue;
+        struct record rec;
+        memcpy(&rec, db->data + offset, REC_HDR_SIZE); // NOLINT [C11 Annex K]
+        rec.offset = offset;
+        rec.val = (const char *)db->data + offset + REC_HDR_SIZE;
+        publish_record(db, &rec);
+    }
+}
+
+static void *scan_main(void *arg)
+{
+    struct scan *scan = arg;
+    while (1) {
+        size_t i = atomic_fetch_add_explicit(&scan->next_file, 1, memory_order_relaxed);
+        if (i >= scan->num_files)
+            break;
+        scan_records(scan->db, &scan->files[i]);
+    }
+    return NULL;
+}
+
+static void *index_main(void *arg)
+{
+    struct scan *scan = arg;
+    while (1) {
+        dbid_t from = atomic_fetch_add_explicit(&scan->next_id, SCAN_CHUNK, memory_order_relaxed);
+        if (from >= scan->num_ids)
+            break;
+        dbid_t to = (from + SCAN_CHUNK < scan->num_ids) ? from + SCAN_CHUNK : scan->num_ids;
+        index_entries(scan->db, scan->from, from, to);
+    }
+    return NULL;
+}
+
+// Runs fn on the calling thread and up to count - 1 more
+static void run_parallel(size_t count, void *(*fn)(void *), void *arg)
+{
+    pthread_t threads[SCAN_THREADS];
+    size_t started = 0;
+    for (; started + 1 < count && started < SCAN_THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, fn, arg))
+            break;
+    }
+    fn(arg);
+    for (size_t i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// NOTE: Fills the index by walking the records from the position on, in the
+// database file and the segments. Used when the index file is missing, i.e.
+// for new databases and for ones created before the index, and after a crash.
+// The append position and the next id are recovered as well.
+// The files are scanned in parallel, each by one thread, and every record
+// claims the entry of its id. A second pass, parallel over the ids, then
+// fills in the entries from the records that won. Records after the position
+// always win over entries already in the index.
+static int build_index(struct db *db, uint64_t from)
+{
+    int ret = ERR;
+    struct scan scan = {0};
+    scan.db = db;
+    scan.from = from;
+    scan.files = calloc(db->segments_end - db->base_zones + 1, sizeof *scan.files);
+    if (!scan.files)
+        return ERR;
+
+    // Snapshots are never taken in the middle of the database file
+    if (from < zone_start(db->base_zones)) {
+        db->zoned_from = zone_of(from);
+        scan.files[scan.num_files].start = from;
+        scan.files[scan.num_files++].end = get_file_size(db->fd);
+    }
+    for (uint64_t zone = db->base_zones; zone < db->segments_end; zone++) {
+        if (zone_start(zone + 1) <= from)
+            continue;
+        int fd = zone_fd(db, zone);
+        if (fd < 0)
+            continue;
+        scan.files[scan.num_files].start = (zone_start(zone) < from) ? from : zone_start(zone);
+        scan.files[scan.num_files++].end = zone_start(zone) + get_file_size(fd);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = (cpus > 0) ? (size_t)cpus : 1;
+    if (scan.num_files)
+        run_parallel((threads < scan.num_files) ? threads : scan.num_files, scan_main, &scan);
+
+    uint64_t count = 0;
+    dbid_t next_id = atomic_load_explicit(&db->meta->id, memory_order_relaxed);
+    for (size_t i = 0; i < scan.num_files; i++) {
+        if (scan.files[i].ret != OK)
+            goto out;
+        count += scan.files[i].count;
+        if (scan.files[i].next_id > next_id)
+            next_id = scan.files[i].next_id;
+    }
+
+    // Appends continue after the last intact record of the last segment. What
+    // follows it is cut off, so that it can't be mistaken for records later.
+    // Sealed segments were synced, so they aren't torn, and are left alone.
+    uint64_t tail = atomic_load_explicit(&db->tail, memory_order_relaxed);
+    struct scan_file *last = &scan.files[scan.num_files ? scan.num_files - 1 : 0];
+    uint64_t zone = zone_of(last->start);
+    if (scan.num_files && zone >= db->base_zones && !db->zones[zone].sealed) {
+        tail = last->last;
+        if (tail < last->end && ftruncate(zone_fd(db, zone), (off_t)file_offset(db, tail)) < 0) {
+            perror("DB: Failed to truncate the last segment");
+            goto out;
+        }
+    }
+
+    scan.num_ids = next_id;
+    size_t chunks = (size_t)(next_id / SCAN_CHUNK) + 1;
+    run_parallel((threads < chunks) ? threads : chunks, index_main, &scan);
+
+    atomic_store_explicit(&db->tail, tail, memory_order_relaxed);
+    atomic_store_explicit(&db->meta->id, next_id, memory_order_relaxed);
+    if (count)
+        fprintf(stderr, "DB: Indexed %lu records\n", count);
+    ret = OK;
+
+out:
+    free(scan.files);
+    return ret;
+}
+
+// NOTE: Writes the index as of the position to the snapshot file. Every record
+// before the position must be published and synced by now. Entries of records
+// after it are left out, they are restored by replaying the log from there.
+static int write_snapshot(struct db *db, uint64_t position)
+{
+    int ret = ERR;
+    char *path = path_with(db->path, SNAPSHOT_SUFFIX);
+    char *tmp = path_with(db->path, SNAPSHOT_SUFFIX ".tmp");
+    struct snapshot_entry *batch = malloc(SNAPSHOT_BATCH * sizeof *batch);
+    int fd = -1;
+    if (!path || !tmp || !batch)
+        goto out;
+
+    struct snapshot_header header = {0};
+    header.magic = SNAPSHOT_MAGIC;
+    header.position = position;
+    header.count = atomic_load_explicit(&db->meta->id, memory_order_relaxed);
+    header.zoned_from = db->zoned_from;
+    uint64_t capacity = atomic_load_explicit(&db->capacity, memory_order_acquire);
+    if (header.count > capacity)
+        header.count = capacity;
+
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if (fd < 0 || write(fd, &header, sizeof header) != sizeof header)
+        goto out;
+    for (dbid_t id = 0; id < header.count;) {
+        size_t n = 0;
+        for (; n < SNAPSHOT_BATCH && id < header.count; n++, id++) {
+            uint64_t offset, expires;
+            uint32_t vlen;
+            read_entry(&db->entries[id], &offset, &vlen, &expires);
+            if (offset >= position)
+                offset = 0;
+            batch[n].offset = offset;
+            batch[n].vlen = vlen;
+            batch[n].expires = expires;
+        }
+        if (write(fd, batch, n * sizeof *batch) != (ssize_t)(n * sizeof *batch))
+            goto out;
+    }
+    if (fdatasync(fd) < 0 || rename(tmp, path) < 0)
+        goto out;
+    db->snapshot_position = position;
+    ret = OK;
+
+out:
+    if (ret != OK)
+        perror("DB: Failed to write the index snapshot");
+    if (fd >= 0)
+        close(fd);
+    free(batch);
+    free(tmp);
+    free(path);
+    return ret;
+}
+
+// Fills the empty index from the snapshot, if there is a usable one. Returns
+// the position the log has to be scanned from, the start of the records if
+// there is no snapshot.
+static uint64_t load_snapshot(struct db *db)
+{
+    uint64_t from = data_start(db->meta);
+    char *path = path_with(db->path, SNAPSHOT_SUFFIX);
+    if (!path)
+        return from;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return from;
+
+    uint64_t size = get_file_size(fd);
+    void *map = (size >= sizeof(struct snapshot_header)) ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+        return from;
+
+    const struct snapshot_header *header = map;
+    const struct snapshot_entry *entries = (const void *)(header + 1);
+    if (header->magic != SNAPSHOT_MAGIC || header->count >= INDEX_MAX_ENTRIES ||
+        size != sizeof *header + header->count * sizeof *entries ||
+        header->position < zone_start(db->base_zones) || header->position > DATA_MAP_SIZE ||
+        (header->count && reserve_index(db, header->count - 1) != OK)) {
+        fprintf(stderr, "DB: Ignoring an unusable index snapshot\n");
+        munmap(map, size);
+        return from;
+    }
+
+    // Entries in zones compacted since are gone, or were moved by records
+    // that the scan finds. Small values are copied into their entries again,
+    // unless their record is past the end of its file.
+    uint64_t now = unix_time();
+    uint64_t restored = 0;
+    uint64_t sized_zone = UINT64_MAX;
+    uint64_t file_size = 0;
+    for (dbid_t id = 0; id < header->count; id++) {
+        struct snapshot_entry e = entries[id];
+        uint64_t zone = zone_of(e.offset);
+        if (e.offset == 0 || zone >= NUM_ZONES || zone_fd(db, zone) < 0 || is_expired(e.expires, now))
+            continue;
+        const void *val = NULL;
+        if (rec_len(e.vlen) <= db->inline_max) {
+            if (zone != sized_zone) {
+                sized_zone = zone;
+                file_size = get_file_size(zone_fd(db, zone));
+            }
+            if (file_offset(db, e.offset) + rec_size(e.vlen) <= file_size)
+                val = db->data + e.offset + REC_HDR_SIZE;
+        }
+        publish_entry(db, id, e.offset, e.vlen & ~ENTRY_INLINE, e.expires, val);
+        restored++;
+    }
+    if (header->count > atomic_load_explicit(&db->meta->id, memory_order_relaxed))
+        atomic_store_explicit(&db->meta->id, header->count, memory_order_relaxed);
+    db->zoned_from = header->zoned_from;
+    db->snapshot_position = header->position;
+    fprintf(stderr, "DB: Restored %lu index entries from the snapshot, replaying the log from offset %lu\n",
+            restored, header->position);
+    from = header->position;
+    munmap(map, size);
+    return from;
+}
+
+// NOTE: Maps the index file. With huge pages, the mapping is aligned to one,
+// and the kernel is asked to back it with them. For a file, it does that where
+// the file system supports large folios.
+static void *map_index(int fd, bool huge_pages)
+{
+    if (!huge_pages)
+        return mmap(NULL, INDEX_MAP_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd, 0);
+
+    size_t size = INDEX_MAP_SIZE + HUGE_PAGE_SIZE;
+    uint8_t *area = mmap(NULL, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED)
+        return MAP_FAILED;
+    uint8_t *start = (uint8_t *)(((uintptr_t)area + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    void *map = mmap(start, INDEX_MAP_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE|MAP_FIXED, fd, 0);
+    if (map == MAP_FAILED) {
+        munmap(area, size);
+        return MAP_FAILED;
+    }
+    // Give back the rest of the reserved range
+    if (start > area)
+        munmap(area, (size_t)(start - area));
+    munmap(start + INDEX_MAP_SIZE, (size_t)(area + size - (start + INDEX_MAP_SIZE)));
+    if (madvise(map, INDEX_MAP_SIZE, MADV_HUGEPAGE) < 0)
+        fprintf(stderr, "DB: Huge pages are not available for the index (%s)\n", strerror(errno));
+    return map;
+}
+
+// Reads the index in, and maps all of it, so that the first requests don't
+// take page faults across it
+static void prefault_index(struct db *db)
+{
+    size_t size = index_size(atomic_load_explicit(&db->capacity, memory_order_relaxed));
+    madvise(db->idx, size, MADV_WILLNEED);
+    if (madvise(db->idx, size, MADV_POPULATE_READ) == 0)
+        return;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < size; off += page)
+        (void)*((const volatile uint8_t *)db->idx + off);
+}
+
+static int open_index(struct db *db, const char *path, const struct db_params *params, bool rebuild)
+{
+    uint64_t capacity = params->capacity;
+    uint64_t requested = capacity;
+    char *idxpath = path_with(path, INDEX_SUFFIX);
+    if (!idxpath) return ERR;
+
+    bool exists = !rebuild && access(idxpath, F_OK) == 0;
+    int fd = open(idxpath, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+    free(idxpath);
+    if (fd < 0) return ERR;
+
+    if (exists) {
+        struct index_header header = {0};
+        if (read(fd, &header, sizeof header) != sizeof header ||
+            header.magic != INDEX_MAGIC || !header.clean ||
+            get_file_size(fd) != index_size(header.capacity)) {
+            // Unusable index, rebuild it from the data file
+            if (header.magic == INDEX_MAGIC && !header.clean)
+                fprintf(stderr, "DB: Database was not closed cleanly, rebuilding the index\n");
+            exists = false;
+        } else {
+            capacity = header.capacity;
+            db->zoned_from = header.zoned_from;
+        }
+    }
+
+    if (capacity == 0)
+        capacity = 1;
+    if (!exists && ftruncate(fd, 0) < 0) {
+        close(fd);
+        return ERR;
+    }
+    if (!exists && ftruncate(fd, (off_t)index_size(capacity)) < 0) {
+        close(fd);
+        return ERR;
+    }
+
+    void *map = map_index(fd, params->huge_pages);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return ERR;
+    }
+
+    db->idxfd = fd;
+    db->idx = map;
+    db->entries = (struct index_entry *)(void *)((uint8_t *)map + sizeof(struct index_header));
+    atomic_store_explicit(&db->capacity, capacity, memory_order_relaxed);
+
+    if (!exists) {
+        db->idx->capacity = capacity;
+        if (build_index(db, rebuild ? data_start(db->meta) : load_snapshot(db)) != OK)
+            return ERR;
+        db->idx->zoned_from = db->zoned_from;
+        db->idx->magic = INDEX_MAGIC;
+    }
+
+    // A larger capacity may have been asked for since the index was created
+    if (atomic_load_explicit(&db->capacity, memory_order_relaxed) < requested &&
+        grow_index(db, requested) != OK)
+        return ERR;
+    if (params->prefault)
+        prefault_index(db);
+
+    // Until close_db, the index on disk may lag behind
+    db->idx->clean = 0;
+    if (msync(db->idx, sizeof(struct index_header), MS_SYNC) < 0)
+        return ERR;
+    return OK;
+}
+
+// Syncs the data and the index, and marks the index as usable for the next open
+static void sync_index(struct db *db)
+{
+    uint64_t capacity = atomic_load_explicit(&db->capacity, memory_order_relaxed);
+    if (fdatasync(db->fd) < 0)
+        return;
+    for (uint64_t zone = db->sealed_until; zone < db->segments_end; zone++) {
+        int fd = zone_fd(db, zone);
+        if (fd >= 0 && !db->zones[zone].sealed && fdatasync(fd) < 0)
+            return;
+    }
+    if (msync(db->idx, index_size(capacity), MS_SYNC) < 0)
+        return;
+    db->idx->clean = 1;
+    msync(db->idx, sizeof(struct index_header), MS_SYNC);
+}
+
+// NOTE: Sleeps until the deadline (get_time), or until the database is closed.
+// Returns false in the latter case. With wake set, also returns once a new
+// segment has been started.
+static bool background_sleep(struct db *db, uint64_t deadline, bool wake)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)(deadline / 1000000000ULL);
+    ts.tv_nsec = (long)(deadline % 1000000000ULL);
+
+    pthread_mutex_lock(&db->background_lock);
+    while (!db->stopping && !(wake && db->segment_started) && get_time() < deadline) {
+        if (pthread_cond_timedwait(&db->background_cond, &db->background_lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    if (wake)
+        db->segment_started = false;
+    bool running = !db->stopping;
+    pthread_mutex_unlock(&db->background_lock);
+    return running;
+}
+
+// NOTE: Keeps compaction at compact_rate bytes per second on average, so that
+// it doesn't compete with requests for the disk. Returns false if the database
+// is being closed.
+static bool compact_throttle(struct db *db, uint64_t started, uint64_t bytes)
+{
+    uint64_t due = started + bytes * 1000000000ULL / db->compact_rate;
+    if (due <= get_time() + COMPACT_SLACK)
+        return true;
+    return background_sleep(db, due, false);
+}
+
+static bool wait_unpinned(struct db *db, uint64_t zone)
+{
+    while (zone_pins(db, zone)) {
+        if (!background_sleep(db, get_time() + COMPACT_SLACK, false))
+            return false;
+    }
+    return true;
+}
+
+// Where a record of the compacted zone was copied to
+struct moved
+{
+    uint64_t from;
+    uint64_t to;
+    dbid_t owner;
+};
+
+static struct moved *find_moved(struct moved *table, size_t mask, uint64_t from)
+{
+    size_t i = (size_t)(from / REC_HDR_SIZE) & mask;
+    while (table[i].from && table[i].from != from)
+        i = (i + 1) & mask;
+    return &table[i];
+}
+
+// Copies the record at the offset to the tail, as is
+static int copy_record(struct db *db, uint64_t offset, struct moved *moved)
+{
+    struct record rec;
+    memcpy(&rec, db->data + offset, REC_HDR_SIZE); // NOLINT [C11 Annex K]
+    rec.val = (const char *)db->data + offset + REC_HDR_SIZE;
+    // The header stays the same, and so does the checksum
+    if (rec.vlen & REC_CHECKSUM)
+        memcpy(&rec.crc, rec.val + rec_len(rec.vlen), REC_CRC_SIZE); // NOLINT [C11 Annex K]
+    uint64_t to;
+    if (reserve_range(db, slot_size(db, rec.vlen), &to) != OK)
+        return ERR;
+    rec.offset = to;
+    int ret = write_record(db, &rec);
+    end_write(db, to);
+    moved->from = offset;
+    moved->to = to;
+    moved->owner = rec.id;
+    return ret;
+}
+
+// Lets the id keep naming a moved record, which is stored under another id
+static int write_alias(struct db *db, dbid_t id, uint64_t offset, uint32_t vlen, uint64_t expires, uint64_t *pos)
+{
+    struct alias alias = {offset, vlen & ~ENTRY_INLINE};
+    struct record rec = {0};
+    rec.vlen = (uint32_t)sizeof alias | (REC_ALIAS << REC_CODEC_SHIFT) | REC_CHECKSUM;
+    rec.id = id;
+    rec.expires = DBID_FREE;
+    if (expires) {
+        rec.vlen |= REC_EXPIRES;
+        rec.expires = expires;
+    }
+    rec.val = (const char *)&alias;
+    checksum_record(&rec);
+    if (reserve_range(db, slot_size(db, rec.vlen), pos) != OK)
+        return ERR;
+    rec.offset = *pos;
+    int ret = write_record(db, &rec);
+    end_write(db, *pos);
+    return ret;
+}
+
+// Removes the segment of a compacted zone, returns its size
+static uint64_t remove_segment(struct db *db, uint64_t zone)
+{
+    pthread_mutex_lock(&db->segment_lock);
+    int fd = zone_fd(db, zone);
+    uint64_t size = get_file_size(fd);
+    db->zones[zone].listed = false;
+    db->zones[zone].sealed = false;
+    // The segment is gone once the manifest doesn't list it, the file is just
+    // left over if removing it fails
+    write_manifest(db);
+    atomic_store_explicit(&db->zones[zone].fd, -1, memory_order_relaxed);
+    unmap_zone(db, zone);
+    close(fd);
+    char *path = segment_path(db, zone);
+    if (path)
+        unlink(path);
+    free(path);
+    pthread_mutex_unlock(&db->segment_lock);
+    return size;
+}
+
+// NOTE: Moves the live records of the zone to the tail, repoints their entries
+// and removes the zone: its segment is deleted, a zone of the database file is
+// punched out of it. Readers carry on throughout: an entry always names a
+// complete copy of its record, and the old copies go only once nobody has the
+// zone pinned anymore.
+static int compact_zone(struct db *db, uint64_t zone, uint64_t live)
+{
+    uint64_t start = zone_start(zone);
+    uint64_t end = start + ZONE_SIZE;
+    int ret = ERR;
+    dbid_t *ids = NULL;
+    struct moved *table = NULL;
+
+    // No new aliases to records of the zone from here on. Wait for the
+    // inserts that may be adding one.
+    atomic_store_explicit(&db->zones[zone].state, ZONE_COMPACTING, memory_order_seq_cst);
+    if (!wait_unpinned(db, zone))
+        goto out;
+
+    // Take the ids naming records of the zone
+    size_t num_ids = 0;
+    if (live) {
+        size_t cap = 1024;
+        ids = malloc(cap * sizeof *ids);
+        if (!ids)
+            goto out;
+        dbid_t count = atomic_load_explicit(&db->meta->id, memory_order_relaxed);
+        uint64_t capacity = atomic_load_explicit(&db->capacity, memory_order_acquire);
+        if (count > capacity)
+            count = capacity;
+        for (dbid_t id = 0; id < count; id++) {
+            uint64_t offset, expires;
+            uint32_t vlen;
+            read_entry(&db->entries[id], &offset, &vlen, &expires);
+            if (offset == 0 || offset < start || offset >= end)
+                continue;
+            if (num_ids == cap) {
+                cap *= 2;
+                dbid_t *tmp = realloc(ids, cap * sizeof *ids);
+                if (!tmp)
+                    goto out;
+                ids = tmp;
+            }
+            ids[num_ids++] = id;
+        }
+    }
+
+    size_t slots = 1;
+    while (slots < num_ids * 2)
+        slots <<= 1;
+    table = calloc(slots, sizeof *table);
+    if (!table)
+        goto out;
+    size_t mask = slots - 1;
+
+    uint64_t started = get_time();
+    uint64_t copied = 0;
+    uint64_t first = UINT64_MAX;
+    uint64_t last = 0;
+    for (size_t i = 0; i < num_ids; i++) {
+        dbid_t id = ids[i];
+        uint64_t offset, expires;
+        uint32_t vlen;
+        read_entry(&db->entries[id], &offset, &vlen, &expires);
+
+        // Records named by several ids are copied once
+        struct moved *moved = find_moved(table, mask, offset);
+        uint64_t pos = moved->to;
+        if (!moved->from) {
+            if (copy_record(db, offset, moved) != OK)
+                goto out;
+            pos = moved->to;
+            copied += slot_size(db, vlen);
+        }
+        if (moved->owner != id) {
+            if (write_alias(db, id, moved->to, vlen, expires, &pos) != OK)
+                goto out;
+            copied += REC_HDR_SIZE + sizeof(struct alias) + REC_CRC_SIZE;
+        }
+        publish_entry(db, id, moved->to, vlen, expires, NULL);
+        if (pos < first)
+            first = pos;
+        if (pos > last)
+            last = pos;
+
+        if (!compact_throttle(db, started, copied))
+            goto out;
+    }
+
+    // The copies must be on disk before the originals are gone
+    if (num_ids) {
+        struct write_batch writes = start_writes(db);
+        sync_zones(db, &writes, zone_of(first), zone_of(last));
+        if (finish_writes(&writes) != OK)
+            goto out;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!wait_unpinned(db, zone))
+        goto out;
+
+    if (zone >= db->base_zones) {
+        atomic_fetch_add_explicit(&db->reclaimed, remove_segment(db, zone), memory_order_relaxed);
+    } else {
+        uint64_t from = (start < data_start(db->meta)) ? data_start(db->meta) : start;
+        if (fallocate(db->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)from, (off_t)(end - from)) < 0) {
+            perror("DB: Failed to punch out a compacted zone");
+            goto out;
+        }
+        atomic_fetch_add_explicit(&db->reclaimed, end - from, memory_order_relaxed);
+    }
+    atomic_store_explicit(&db->zones[zone].state, ZONE_PUNCHED, memory_order_relaxed);
+    ret = OK;
+
+out:
+    if (ret != OK)
+        atomic_store_explicit(&db->zones[zone].state, ZONE_OPEN, memory_order_relaxed);
+    free(table);
+    free(ids);
+    return ret;
+}
 
-    pthread_rwlock_t lock;
+// Drops expired entries, and compacts the zones they left mostly empty
+static void compact_pass(struct db *db)
+{
+    uint64_t now = unix_time();
+    // Only the database file and sealed segments are compacted
+    uint64_t last = db->sealed_until;
+    uint64_t *live = calloc(last, sizeof *live);
+    if (!live)
+        return;
 
-    struct header *meta;
-    dbid_t *buckets;
-    void *map;
-};
+    dbid_t count = atomic_load_explicit(&db->meta->id, memory_order_relaxed);
+    uint64_t capacity = atomic_load_explicit(&db->capacity, memory_order_acquire);
+    if (count > capacity)
+        count = capacity;
+    for (dbid_t id = 0; id < count; id++) {
+        uint64_t offset, expires;
+        uint32_t vlen;
+        read_entry(&db->entries[id], &offset, &vlen, &expires);
+        if (offset == 0)
+            continue;
+        if (is_expired(expires, now)) {
+            publish_entry(db, id, 0, 0, 0, NULL);
+            atomic_fetch_add_explicit(&db->expired, 1, memory_order_relaxed);
+            continue;
+        }
+        if (zone_of(offset) < last)
+            live[zone_of(offset)] += slot_size(db, vlen);
+    }
 
-struct record
-{
-    uint32_t vlen;
-    dbid_t id;
-    dbid_t next;
+    for (uint64_t zone = db->zoned_from; zone < last; zone++) {
+        int fd = zone_fd(db, zone);
+        if (fd < 0 || live[zone] >= COMPACT_LIVE_MIN ||
+            atomic_load_explicit(&db->zones[zone].state, memory_order_relaxed) == ZONE_PUNCHED)
+            continue;
 
-    dbid_t offset;
+        // Zones of the database file punched before it was last opened have
+        // no data left
+        if (zone < db->base_zones && !live[zone]) {
+            off_t data = lseek(fd, (off_t)zone_start(zone), SEEK_DATA);
+            if (data < 0 || (uint64_t)data >= zone_start(zone + 1)) {
+                atomic_store_explicit(&db->zones[zone].state, ZONE_PUNCHED, memory_order_relaxed);
+                continue;
+            }
+        }
+        if (compact_zone(db, zone, live[zone]) != OK)
+            break;
+    }
+    free(live);
+}
 
-    const char *val;
-};
-#pragma pack(pop)
+// Seals the segments the tail has moved past, once nobody writes to them anymore
+static void seal_segments(struct db *db)
+{
+    uint64_t tail = zone_of(atomic_load_explicit(&db->tail, memory_order_seq_cst));
+    for (; db->sealed_until < tail; db->sealed_until++) {
+        uint64_t zone = db->sealed_until;
+        while (atomic_load_explicit(&db->zones[zone].writers, memory_order_seq_cst)) {
+            if (!background_sleep(db, get_time() + COMPACT_SLACK, false))
+                return;
+        }
+        int fd = zone_fd(db, zone);
+        if (fd < 0 || db->zones[zone].sealed)
+            continue;
+        if (fdatasync(fd) < 0 || fchmod(fd, S_IRUSR) < 0) {
+            perror("DB: Failed to seal a segment");
+            return;
+        }
+        pthread_mutex_lock(&db->segment_lock);
+        db->zones[zone].sealed = true;
+        write_manifest(db);
+        pthread_mutex_unlock(&db->segment_lock);
+    }
+}
 
-static inline uint64_t get_file_size(int fd)
+// NOTE: Seals segments as the tail moves on, and every compact_interval seconds,
+// drops expired entries from the index and reclaims the space of their records
+// by compacting the zones they were in. Every snapshot_interval seconds, if
+// segments were sealed since the last one, snapshots the index up to the first
+// unsealed segment. Compaction doesn't move records meanwhile, as it runs on
+// this thread as well.
+static void *background_main(void *arg)
 {
-    struct stat fs;
-    if (fstat(fd, &fs) < 0) return 0;
-    return (uint64_t)fs.st_size;
+    struct db *db = arg;
+    uint64_t interval = db->compact_interval * 1000000000ULL;
+    uint64_t next_pass = get_time() + interval;
+    uint64_t snapshot_interval = db->snapshot_interval * 1000000000ULL;
+    uint64_t next_snapshot = get_time() + snapshot_interval;
+    while (1) {
+        seal_segments(db);
+        if (db->compact_interval && get_time() >= next_pass) {
+            compact_pass(db);
+            next_pass = get_time() + interval;
+        }
+        if (db->snapshot_interval && get_time() >= next_snapshot) {
+            uint64_t position = zone_start(db->sealed_until);
+            if (position > db->snapshot_position && fdatasync(db->fd) == 0)
+                write_snapshot(db, position);
+            next_snapshot = get_time() + snapshot_interval;
+        }
+        // Woken up early when a new segment is started
+        uint64_t deadline = db->compact_interval ? next_pass : UINT64_MAX;
+        if (db->snapshot_interval && next_snapshot < deadline)
+            deadline = next_snapshot;
+        if (!background_sleep(db, deadline, true))
+            break;
+    }
+    return NULL;
 }
 
-static inline int write_record(int fd, const struct record *rec)
+// NOTE: Switches to direct mode, records are aligned to the block size of the
+// file system. Stays with the page cache if the file system can't do O_DIRECT.
+static int setup_direct(struct db *db, size_t pool_size)
 {
-    size_t size = REC_HDR_SIZE + rec->vlen;
-    uint8_t *buf = malloc(size);
-    if (!buf) return ERR;
+    int fd = open(db->path, O_RDONLY|O_DIRECT);
+    if (fd < 0) {
+        fprintf(stderr, "DB: O_DIRECT is not available (%s), using the page cache\n", strerror(errno));
+        return OK;
+    }
+    struct stat st;
+    uint32_t align = DIRECT_ALIGN_DEFAULT;
+    if (fstat(fd, &st) == 0 && st.st_blksize >= DIRECT_ALIGN_MIN && st.st_blksize <= DIRECT_ALIGN_MAX &&
+        !(st.st_blksize & (st.st_blksize - 1)))
+        align = (uint32_t)st.st_blksize;
+    close(fd);
 
-    uint8_t *dst = buf;
-    memcpy(dst, rec, REC_HDR_SIZE); // NOLINT [C11 Annex K]
-    dst += REC_HDR_SIZE;
-    memcpy(dst, rec->val, rec->vlen); // NOLINT [C11 Annex K]
+    db->pool = create_cache(pool_size);
+    if (!db->pool)
+        return ERR;
+    db->align = align;
+    return OK;
+}
 
-    int ret = OK;
-    if (pwrite(fd, buf, size, (off_t)rec->offset) < 0)
-        ret = ERR;
-    free(buf);
-    return ret;
+// Evicts the files of the segments from the page cache, e.g. after scanning
+// them, as direct mode doesn't read through it
+static void drop_cached(struct db *db)
+{
+    for (uint64_t zone = db->base_zones; zone < db->segments_end; zone++) {
+        int fd = zone_fd(db, zone);
+        if (fd < 0)
+            continue;
+        madvise((void *)(uintptr_t)(db->data + zone_start(zone)), ZONE_SIZE, MADV_DONTNEED);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+// NOTE: Falls back to plain system calls if the kernel lacks io_uring. The
+// ring created to find out is kept for the calling thread.
+static void setup_uring(struct db *db)
+{
+    if (pthread_key_create(&db->ring_key, destroy_ring)) {
+        fprintf(stderr, "DB: Failed to create the ring key, not using io_uring\n");
+        return;
+    }
+    struct uring *ring = create_uring(RING_ENTRIES);
+    if (!ring) {
+        fprintf(stderr, "DB: io_uring is not available (%s), using plain system calls\n", strerror(errno));
+        pthread_key_delete(db->ring_key);
+        return;
+    }
+    if (pthread_setspecific(db->ring_key, ring)) {
+        destroy_uring(ring);
+        pthread_key_delete(db->ring_key);
+        return;
+    }
+    db->uring = true;
 }
 
 struct db *open_db(const char *path, const struct db_params *params)
 {
-    struct db *db = calloc(1, sizeof *db);
+    struct db *db = aligned_alloc(_Alignof(struct db), sizeof *db);
     if (!db) return NULL;
-    if (pthread_rwlock_init(&db->lock, NULL)) {
+    zero_structp(db);
+    db->fd = -1;
+    db->idxfd = -1;
+    db->map = MAP_FAILED;
+    db->data = MAP_FAILED;
+    db->idx = MAP_FAILED;
+    db->durability = params->durability;
+    db->commit_window = params->commit_window;
+    db->compression = params->compression;
+    db->inline_max = (params->inline_max < INDEX_INLINE_MAX) ? params->inline_max : INDEX_INLINE_MAX;
+    db->compact_interval = params->compact_interval;
+    db->compact_rate = params->compact_rate ? params->compact_rate : UINT64_MAX;
+    db->snapshot_interval = params->snapshot_interval;
+    db->commit.tail = &db->commit.head;
+    if (pthread_mutex_init(&db->grow_lock, NULL)) {
         free(db);
         return NULL;
     }
+    if (pthread_mutex_init(&db->commit.lock, NULL)) {
+        pthread_mutex_destroy(&db->grow_lock);
+        free(db);
+        return NULL;
+    }
+    if (pthread_cond_init(&db->commit.cond, NULL)) {
+        pthread_mutex_destroy(&db->commit.lock);
+        pthread_mutex_destroy(&db->grow_lock);
+        free(db);
+        return NULL;
+    }
+    if (pthread_mutex_init(&db->background_lock, NULL)) {
+        pthread_cond_destroy(&db->commit.cond);
+        pthread_mutex_destroy(&db->commit.lock);
+        pthread_mutex_destroy(&db->grow_lock);
+        free(db);
+        return NULL;
+    }
+    if (pthread_cond_init(&db->background_cond, NULL)) {
+        pthread_mutex_destroy(&db->background_lock);
+        pthread_cond_destroy(&db->commit.cond);
+        pthread_mutex_destroy(&db->commit.lock);
+        pthread_mutex_destroy(&db->grow_lock);
+        free(db);
+        return NULL;
+    }
+    if (pthread_mutex_init(&db->segment_lock, NULL)) {
+        pthread_cond_destroy(&db->background_cond);
+        pthread_mutex_destroy(&db->background_lock);
+        pthread_cond_destroy(&db->commit.cond);
+        pthread_mutex_destroy(&db->commit.lock);
+        pthread_mutex_destroy(&db->grow_lock);
+        free(db);
+        return NULL;
+    }
+    if (params->io_uring)
+        setup_uring(db);
 
-    if (access(path, F_OK) < 0) {
-        int fd = open(path, O_RDWR|O_CREAT, S_IRWXU);
-        if (fd < 0) {
-            // TODO: Logging
+    if (params->dedup) {
+        db->dedup = calloc(DEDUP_SLOTS, sizeof *db->dedup);
+        if (!db->dedup)
             goto error;
-        }
+    }
+    db->zones = calloc(NUM_ZONES, sizeof *db->zones);
+    db->path = strdup(path);
+    if (!db->zones || !db->path)
+        goto error;
 
-        size_t size = sizeof(struct header) + sizeof(dbid_t) * params->num_buckets;
-        if (ftruncate(fd, (off_t)size) < 0) {
+    int fd;
+    bool created = access(path, F_OK) < 0;
+    if (created) {
+        fd = open(path, O_RDWR|O_CREAT, S_IRWXU);
+        if (fd < 0) {
             // TODO: Logging
-            close(fd);
             goto error;
         }
 
-        void *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-        if (map == MAP_FAILED) {
+        struct header header = {0};
+        if (pwrite(fd, &header, sizeof header, 0) != sizeof header) {
             // TODO: Logging
             close(fd);
             goto error;
         }
-
-        struct header *meta = map;
-        meta->id = 0;
-        meta->num_buckets = params->num_buckets;
-
-        dbid_t *buckets = (dbid_t *)(void *)((uint8_t *)map + sizeof(struct header));
-        memset(buckets, 0xff, sizeof(dbid_t) * params->num_buckets); // NOLINT [C11 Annex K]
-
-        db->fd = fd;
-        db->meta = meta;
-        db->buckets = buckets;
-        db->map = map;
     } else {
-        int fd = open(path, O_RDWR);
+        fd = open(path, O_RDWR);
         if (fd < 0) {
             // TODO: Logging
             goto error;
         }
+    }
 
-        struct header header = {0};
-        if (read(fd, &header, sizeof header) != sizeof header) {
-            // TODO: Logging
-            close(fd);
-            goto error;
-        }
+    void *map = mmap(NULL, sizeof(struct header), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        // TODO: Logging
+        close(fd);
+        goto error;
+    }
 
-        size_t size = sizeof(struct header) + sizeof(dbid_t) * header.num_buckets;
-        void *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-        if (map == MAP_FAILED) {
-            // TODO: Logging
-            close(fd);
-            goto error;
-        }
+    db->fd = fd;
+    db->meta = map;
+    db->map = map;
+
+    // Address space for the whole record area, the database file and the
+    // segments are mapped into it
+    void *data = mmap(NULL, DATA_MAP_SIZE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        // TODO: Logging
+        goto error;
+    }
+    db->data = data;
+
+    if (params->buffer_pool && setup_direct(db, params->buffer_pool) != OK) {
+        fprintf(stderr, "DB: Failed to create the buffer pool\n");
+        goto error;
+    }
+
+    if (open_segments(db) != OK) {
+        fprintf(stderr, "DB: Failed to open the segments\n");
+        goto error;
+    }
+
+    if (open_index(db, path, params, created) != OK) {
+        fprintf(stderr, "DB: Failed to open the index\n");
+        goto error;
+    }
+
+    // Direct writes start on a block boundary. Appends after records written
+    // without direct mode continue in the next zone, which does.
+    if (db->align) {
+        uint64_t tail = atomic_load_explicit(&db->tail, memory_order_relaxed);
+        if (tail & (db->align - 1))
+            atomic_store_explicit(&db->tail, zone_start(zone_of(tail) + 1), memory_order_relaxed);
+        drop_cached(db);
+    }
 
-        db->fd = fd;
-        db->meta = map;
-        db->buckets = (dbid_t *)(void *)((uint8_t *)map + sizeof(struct header));
-        db->map = map;
+    if (pthread_create(&db->background, NULL, background_main, db)) {
+        fprintf(stderr, "DB: Failed to start the background thread\n");
+        goto error;
     }
+    db->background_started = true;
 
     return db;
 
 error:
-    pthread_rwlock_destroy(&db->lock);
-    free(db);
+    close_db(db);
     return NULL;
 }
 
 void close_db(struct db *db)
 {
-    if (db->map != MAP_FAILED) {
-        size_t size = sizeof(struct header) + sizeof(dbid_t) * db->meta->num_buckets;
-        munmap(db->map, size);
+    if (db->background_started) {
+        pthread_mutex_lock(&db->background_lock);
+        db->stopping = true;
+        pthread_cond_broadcast(&db->background_cond);
+        pthread_mutex_unlock(&db->background_lock);
+        pthread_join(db->background, NULL);
+    }
+    if (db->uring) {
+        destroy_uring(pthread_getspecific(db->ring_key));
+        pthread_key_delete(db->ring_key);
+    }
+
+    // All inserts are done, the snapshot covers the whole log
+    if (db->idx != MAP_FAILED && db->idx->magic == INDEX_MAGIC) {
+        sync_index(db);
+        write_snapshot(db, atomic_load_explicit(&db->tail, memory_order_relaxed));
+    }
+    if (db->idx != MAP_FAILED)
+        munmap(db->idx, INDEX_MAP_SIZE);
+    if (db->idxfd >= 0)
+        close(db->idxfd);
+    if (db->data != MAP_FAILED)
+        munmap((void *)(uintptr_t)db->data, DATA_MAP_SIZE);
+    if (db->map != MAP_FAILED)
+        munmap(db->map, sizeof(struct header));
+    for (uint64_t zone = db->base_zones; zone < db->segments_end; zone++) {
+        int fd = zone_fd(db, zone);
+        if (fd >= 0)
+            close(fd);
     }
     if (db->fd >= 0)
         close(db->fd);
 
+    pthread_mutex_destroy(&db->segment_lock);
+    pthread_cond_destroy(&db->background_cond);
+    pthread_mutex_destroy(&db->background_lock);
+    pthread_cond_destroy(&db->commit.cond);
+    pthread_mutex_destroy(&db->commit.lock);
+    pthread_mutex_destroy(&db->grow_lock);
+    for (int i = 0; i < PIN_SLOTS; i++)
+        free(atomic_load_explicit(&db->pins[i], memory_order_relaxed));
+    destroy_cache(db->pool);
+    free(db->zones);
+    free(db->path);
+    free(db->dedup);
     free(db);
 }
 
-int db_insert(struct db *db, const void *val, uint32_t vlen, dbid_t *result)
+// Writes and syncs the queued inserts. Called by the commit leader with the
+// commit lock held, which is released while doing I/O.
+static void commit_batch(struct db *db)
 {
+    struct commit *c = &db->commit;
+
+    // Take the queued inserts, only the first one if every write is synced separately
+    struct pending *batch = c->head;
+    struct pending *last = batch;
+    size_t n = 1;
+    if (db->durability == DB_DURABILITY_ALWAYS) {
+        c->head = batch->next;
+        batch->next = NULL;
+    } else {
+        for (; last->next; last = last->next)
+            n++;
+        c->head = NULL;
+    }
+    if (!c->head)
+        c->tail = &c->head;
+    c->last_batch = n;
+
+    // Only the leader takes ids, so the batch gets consecutive ones. The file
+    // ranges are consecutive as well, unless the batch crosses into the next
+    // zone, or the compactor appends meanwhile.
+    dbid_t first_id = atomic_load_explicit(&db->meta->id, memory_order_relaxed);
+    dbid_t id = first_id;
+    uint64_t start = 0;
+    uint64_t pos = 0;
+    uint64_t total = 0;
+    struct pending *reserved = batch;
     int ret = OK;
-    if (pthread_rwlock_wrlock(&db->lock))
-        return ERR;
+    for (struct pending *p = batch; p; p = p->next) {
+        uint64_t size = slot_size(db, p->rec.vlen);
+        total += size;
+        p->rec.id = id++;
+        uint64_t offset;
+        if (ret == OK && reserve_range(db, size, &offset) != OK)
+            ret = ERR;
+        if (ret != OK)
+            continue;
+        p->rec.offset = offset;
+        if (p == batch)
+            start = p->rec.offset;
+        pos = p->rec.offset + size;
+        reserved = p->next;
+    }
+    atomic_store_explicit(&db->meta->id, id, memory_order_relaxed);
+    pthread_mutex_unlock(&c->lock);
 
-    dbid_t id = db->meta->id++;
-    dbid_t index = id % db->meta->num_buckets;
-    dbid_t pos = get_file_size(db->fd);
+    if (ret == OK && id > atomic_load_explicit(&db->capacity, memory_order_acquire))
+        ret = reserve_index(db, id - 1);
+    if (ret == OK)
+        grow_index_ahead(db, id - 1);
 
-    dbid_t offset = db->buckets[index];
-    if (offset == DBID_FREE) {
-        // Empty bucket, update it to point to the new entry,
-        // which will act as the head of the list
-        db->buckets[index] = pos;
-    } else {
-        // Bucket is not free. Get the last link in the list.
-        while (1) {
-            struct record rec;
-            if (pread(db->fd, &rec, REC_HDR_SIZE, (off_t)offset) != REC_HDR_SIZE) {
-                // TODO: Logging / Error handling
-                ret = ERR;
-                goto out;
-            }
+    // One write per run of consecutive records, up to IOV_MAX / 3 of them,
+    // and one sync per segment the batch went to. With io_uring, a batch in
+    // a single run is written and synced in one submission.
+    // In direct mode, the batch is packed into one aligned buffer instead.
+    struct write_batch writes = start_writes(db);
+    struct iovec iov[IOV_MAX];
+    char *packed = NULL;
+    if (ret == OK && db->align && !(packed = aligned_alloc(db->align, total)))
+        ret = ERR;
+    char *run = packed;
+    struct pending *p = batch;
+    while (ret == OK && writes.ret == OK && p) {
+        int iovcnt = 0;
+        uint64_t off = p->rec.offset;
+        uint64_t end = off;
+        // NOTE: A run ends at a zone boundary, the next zone is another file
+        for (; p && iovcnt + 3 <= IOV_MAX && p->rec.offset == end &&
+               zone_of(end) == zone_of(off); p = p->next) {
+            checksum_record(&p->rec);
+            if (packed)
+                pack_record(db, &p->rec, run + (end - off));
+            else
+                iovcnt += record_iov(&p->rec, &iov[iovcnt]);
+            end += slot_size(db, p->rec.vlen);
+        }
+        if (packed) {
+            iov[0].iov_base = run;
+            iov[0].iov_len = end - off;
+            iovcnt = 1;
+            run += end - off;
+        }
+        write_iov(db, &writes, off, iov, iovcnt, end - off);
+        // The iovecs are refilled for the next run
+        if (p)
+            submit_writes(&writes);
+    }
+    if (ret == OK && writes.ret == OK)
+        sync_zones(db, &writes, zone_of(start), zone_of(pos - 1));
+    if (finish_writes(&writes) != OK)
+        ret = ERR;
+    free(packed);
 
-            if (rec.next != DBID_FREE) {
-                offset = rec.next;
-            } else {
-                break;
-            }
+    if (ret == OK) {
+        for (p = batch; p; p = p->next)
+            publish_record(db, &p->rec);
+    }
+    for (p = batch; p != reserved; p = p->next)
+        end_write(db, p->rec.offset);
+
+    pthread_mutex_lock(&c->lock);
+    if (ret != OK) {
+        // Give the batch back, unless the compactor has appended since. Later
+        // batches then don't end up behind a hole. Ranges spanning segments
+        // stay taken, the segment before may already be sealed.
+        atomic_store_explicit(&db->meta->id, first_id, memory_order_relaxed);
+        if (reserved != batch && zone_of(start) == zone_of(pos - 1))
+            atomic_compare_exchange_strong_explicit(&db->tail, &pos, start,
+                                                    memory_order_relaxed, memory_order_relaxed);
+    }
+    for (p = batch; p; p = p->next) {
+        p->status = ret;
+        p->done = true;
+    }
+}
+
+static int commit_insert(struct db *db, const void *val, uint32_t vlen, uint64_t expires, dbid_t *result)
+{
+    struct commit *c = &db->commit;
+    struct pending p = {0};
+    p.rec.vlen = vlen | REC_CHECKSUM;
+    p.rec.expires = DBID_FREE;
+    if (expires) {
+        p.rec.vlen |= REC_EXPIRES;
+        p.rec.expires = expires;
+    }
+    p.rec.val = val;
+
+    pthread_mutex_lock(&c->lock);
+    *c->tail = &p;
+    c->tail = &p.next;
+    while (!p.done) {
+        if (c->leader) {
+            pthread_cond_wait(&c->cond, &c->lock);
+            continue;
         }
 
-        // Update the last link to point to the new entry (that is to be added)
-        if (pwrite(db->fd, &pos, sizeof pos, (off_t)(offset + offsetof(struct record, offset))) != sizeof offset) {
-            ret = ERR;
-            goto out;
+        c->leader = true;
+        // Under concurrent load, give other inserts a moment to join the batch
+        if (db->commit_window && c->last_batch > 1) {
+            pthread_mutex_unlock(&c->lock);
+            usleep(db->commit_window);
+            pthread_mutex_lock(&c->lock);
         }
+        commit_batch(db);
+        c->leader = false;
+        pthread_cond_broadcast(&c->cond);
     }
+    pthread_mutex_unlock(&c->lock);
 
-    *result = id;
+    *result = p.rec.id;
+    return p.status;
+}
+
+static int append_record(struct db *db, const void *val, uint32_t vlen, uint64_t expires, dbid_t *result)
+{
+    // Reserve the id and the file range. Everything after this runs in
+    // parallel with other inserts.
+    vlen |= REC_CHECKSUM;
+    uint64_t size = slot_size(db, vlen);
+    dbid_t id = atomic_fetch_add_explicit(&db->meta->id, 1, memory_order_relaxed);
+    uint64_t pos;
+    if (reserve_range(db, size, &pos) != OK)
+        return ERR;
+
+    if (id >= atomic_load_explicit(&db->capacity, memory_order_acquire)) {
+        if (reserve_index(db, id) != OK) {
+            end_write(db, pos);
+            return ERR;
+        }
+    }
+    grow_index_ahead(db, id);
 
     struct record rec = {0};
     rec.vlen = vlen;
     rec.id = id;
-    rec.next = DBID_FREE;
+    rec.expires = DBID_FREE;
+    if (expires) {
+        rec.vlen |= REC_EXPIRES;
+        rec.expires = expires;
+    }
     rec.offset = pos;
     rec.val = val;
-    ret = write_record(db->fd, &rec);
-out:
-    pthread_rwlock_unlock(&db->lock);
-    return ret;
+    checksum_record(&rec);
+    if (write_record(db, &rec) != OK) {
+        end_write(db, pos);
+        return ERR;
+    }
+
+    // Make the record visible to db_get
+    publish_record(db, &rec);
+    end_write(db, pos);
+    *result = id;
+    return OK;
 }
 
-void *db_get(struct db *db, dbid_t id, uint32_t *vlen)
+// Compresses the value, if that makes it meaningfully smaller. Returns the
+// compressed copy, or NULL to store the value as it is.
+static void *compress_value(struct db *db, const void *val, uint32_t *vlen)
 {
-    void *ret = NULL;
-    if (pthread_rwlock_rdlock(&db->lock))
+    size_t len = gzip_bound(*vlen);
+    void *packed = malloc(len);
+    if (!packed)
+        return NULL;
+    if (gzip_compress(val, *vlen, packed, &len, db->compression) != OK || len > *vlen - *vlen / 8) {
+        free(packed);
         return NULL;
+    }
+    *vlen = (uint32_t)len | ((uint32_t)DB_CODEC_GZIP << REC_CODEC_SHIFT);
+    return packed;
+}
 
-    *vlen = 0;
-    dbid_t index = id % db->meta->num_buckets;
-    dbid_t offset = db->buckets[index];
-    if (offset == DBID_FREE)
-        goto out;
+static inline int insert_record(struct db *db, const void *val, uint32_t vlen, uint64_t expires, dbid_t *result)
+{
+    if (db->durability != DB_DURABILITY_NONE)
+        return commit_insert(db, val, vlen, expires, result);
+    return append_record(db, val, vlen, expires, result);
+}
 
-    while (1) {
-        struct record rec;
-        if (pread(db->fd, &rec, REC_HDR_SIZE, (off_t)offset) != REC_HDR_SIZE) {
-            // TODO: Logging / Error handling
-            goto out;
+// NOTE: Looks for an earlier value equal to this one. On a match, fills in the
+// alias naming the record that holds it, and returns the pin that keeps the
+// record in place until the alias has been published.
+static void *find_duplicate(struct db *db, uint64_t hash, const void *val, uint32_t vlen, struct alias *alias)
+{
+    struct dedup_slot *slot = &db->dedup[hash & (DEDUP_SLOTS - 1)];
+    if (atomic_load_explicit(&slot->hash, memory_order_relaxed) != hash)
+        return NULL;
+    dbid_t id = atomic_load_explicit(&slot->id, memory_order_relaxed);
+
+    // NOTE: The slot may be half way through an update. That, and hash
+    // collisions, are caught by comparing the values.
+    uint64_t offset, expires;
+    uint32_t word;
+    void *pin = pin_entry(db, id, &offset, &word, &expires);
+    if (!pin)
+        return NULL;
+    // Values copied into their entries don't pin their records, and are small
+    // enough that an alias would hardly save anything
+    if ((uintptr_t)pin & PIN_INLINE)
+        return NULL;
+    // The compactor may already be past the entries of the zone, an alias
+    // added now would be left behind
+    if (atomic_load_explicit(&db->zones[zone_of(offset)].state, memory_order_seq_cst) != ZONE_OPEN)
+        goto miss;
+
+    struct db_view view;
+    view.data = db->data + offset + REC_HDR_SIZE;
+    view.len = rec_len(word);
+    view.codec = (enum db_codec)rec_codec(word);
+    if (db_size(&view) != vlen)
+        goto miss;
+
+    bool equal;
+    if (view.codec == DB_CODEC_NONE) {
+        equal = memcmp(view.data, val, vlen) == 0;
+    } else {
+        void *tmp = malloc(vlen);
+        equal = tmp && db_decode(&view, tmp) == OK && memcmp(tmp, val, vlen) == 0;
+        free(tmp);
+    }
+    if (!equal)
+        goto miss;
+
+    alias->offset = offset;
+    alias->vlen = word & ~ENTRY_INLINE;
+    return pin;
+
+miss:
+    db_release(pin);
+    return NULL;
+}
+
+int db_insert(struct db *db, const void *val, uint32_t vlen, uint32_t ttl, dbid_t *result)
+{
+    if (vlen == 0 || vlen > ZONE_SIZE - REC_HDR_SIZE - REC_CRC_SIZE ||
+        slot_size(db, vlen | REC_CHECKSUM) > ZONE_SIZE)
+        return ERR;
+    uint64_t expires = ttl ? unix_time() + ttl : 0;
+
+    uint64_t hash = 0;
+    if (db->dedup) {
+        // NOTE: A duplicate gets a new id all the same, but only a small
+        // alias record is written for it, pointing at the existing value.
+        // It expires on its own, the value stays as long as anything names it.
+        hash = hash_bytes(val, vlen, DEDUP_SEED);
+        struct alias alias;
+        void *pin = find_duplicate(db, hash, val, vlen, &alias);
+        if (pin) {
+            atomic_fetch_add_explicit(&db->dedup_hits, 1, memory_order_relaxed);
+            int ret = insert_record(db, &alias, (uint32_t)sizeof alias | (REC_ALIAS << REC_CODEC_SHIFT), expires, result);
+            db_release(pin);
+            return ret;
         }
+    }
 
-        if (rec.id == id) {
-            void *buf = malloc(rec.vlen);
-            if (!buf) {
-                // TODO: Logging / Error handling
-                goto out;
-            }
+    void *packed = NULL;
+    if (db->compression && vlen >= COMPRESS_MIN) {
+        packed = compress_value(db, val, &vlen);
+        if (packed)
+            val = packed;
+    }
 
-            if (pread(db->fd, buf, rec.vlen, (off_t)(offset + REC_HDR_SIZE)) != rec.vlen) {
-                // TODO: Logging / Error handling
-                free(buf);
-                goto out;
+    int ret = insert_record(db, val, vlen, expires, result);
+    free(packed);
+
+    if (db->dedup && ret == OK) {
+        struct dedup_slot *slot = &db->dedup[hash & (DEDUP_SLOTS - 1)];
+        atomic_store_explicit(&slot->hash, hash, memory_order_relaxed);
+        atomic_store_explicit(&slot->id, *result, memory_order_relaxed);
+    }
+    return ret;
+}
+
+int db_resize(struct db *db, uint64_t capacity)
+{
+    if (pthread_mutex_lock(&db->grow_lock))
+        return ERR;
+    int ret = grow_index(db, capacity);
+    pthread_mutex_unlock(&db->grow_lock);
+    return ret;
+}
+
+void db_stats(struct db *db, struct db_stats *stats)
+{
+    stats->count = atomic_load_explicit(&db->meta->id, memory_order_relaxed);
+    stats->capacity = atomic_load_explicit(&db->capacity, memory_order_relaxed);
+    stats->dedup_hits = atomic_load_explicit(&db->dedup_hits, memory_order_relaxed);
+    stats->expired = atomic_load_explicit(&db->expired, memory_order_relaxed);
+    stats->reclaimed = atomic_load_explicit(&db->reclaimed, memory_order_relaxed);
+}
+
+int db_get(struct db *db, dbid_t id, struct db_view *view)
+{
+    uint64_t offset, expires;
+    uint32_t vlen;
+    void *pin = pin_entry(db, id, &offset, &vlen, &expires);
+    if (!pin)
+        return ERR;
+
+    view->data = db->data + offset + REC_HDR_SIZE;
+    view->len = rec_len(vlen);
+    view->codec = (enum db_codec)rec_codec(vlen);
+    view->expires = expires;
+    view->fd = zone_fd(db, zone_of(offset));
+    view->offset = file_offset(db, offset) + REC_HDR_SIZE;
+    view->position = offset;
+    view->pin = pin;
+
+    // Small values are read from the index entry, the record isn't touched
+    if ((uintptr_t)pin & PIN_INLINE) {
+        view->data = ((const struct index_entry *)((uintptr_t)pin & ~(uintptr_t)PIN_INLINE))->data;
+        view->fd = -1;
+        return OK;
+    }
+
+    // NOTE: In direct mode, values come from the buffer pool. Ones that aren't
+    // in it have no data until db_prefetch reads them in, the zone stays
+    // pinned meanwhile.
+    if (db->pool) {
+        view->fd = -1;
+        struct cache_entry *entry = cache_get(db->pool, offset);
+        view->data = entry ? entry->data : NULL;
+        if (entry) {
+            db_release(view->pin);
+            view->pin = (void *)((uintptr_t)entry | PIN_BUFFER);
+        }
+    }
+    return OK;
+}
+
+void db_release(void *pin)
+{
+    if ((uintptr_t)pin & PIN_INLINE)
+        return;
+    if ((uintptr_t)pin & PIN_BUFFER) {
+        cache_release((struct cache_entry *)((uintptr_t)pin & ~(uintptr_t)PIN_BUFFER));
+        return;
+    }
+    atomic_fetch_sub_explicit((_Atomic uint32_t *)pin, 1, memory_order_release);
+}
+
+uint32_t db_size(const struct db_view *view)
+{
+    return (view->codec == DB_CODEC_GZIP) ? gzip_size(view->data, view->len) : view->len;
+}
+
+int db_decode(const struct db_view *view, void *out)
+{
+    switch (view->codec) {
+        case DB_CODEC_NONE: {
+            memcpy(out, view->data, view->len); // NOLINT [C11 Annex K]
+            return OK;
+        }
+
+        case DB_CODEC_GZIP: {
+            return gzip_decompress(view->data, view->len, out, db_size(view));
+        }
+    }
+    return ERR;
+}
+
+// Page range of the value in the mapping
+static inline void view_pages(const struct db_view *view, uintptr_t *start, size_t *len)
+{
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t addr = (uintptr_t)view->data;
+    *start = addr & ~(page - 1);
+    *len = addr + view->len - *start;
+}
+
+bool db_resident(const struct db_view *view)
+{
+    if (!view->data)
+        return false;
+    if ((uintptr_t)view->pin & (PIN_BUFFER | PIN_INLINE))
+        return true;
+    uintptr_t start;
+    size_t len;
+    view_pages(view, &start, &len);
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    unsigned char vec[64];
+    while (len) {
+        size_t chunk = (len < sizeof vec * page) ? len : sizeof vec * page;
+        if (mincore((void *)start, chunk, vec) < 0)
+            return false;
+        for (size_t i = 0; i < (chunk + page - 1) / page; i++) {
+            if (!(vec[i] & 1))
+                return false;
+        }
+        start += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+// Reads ahead all of the values at once, then waits for them page by page
+static void prefetch_views(struct db_view *const *views, uint32_t count)
+{
+    uintptr_t start;
+    size_t len;
+    for (uint32_t i = 0; i < count; i++) {
+        view_pages(views[i], &start, &len);
+        madvise((void *)start, len, MADV_WILLNEED);
+    }
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (uint32_t i = 0; i < count; i++) {
+        view_pages(views[i], &start, &len);
+        for (size_t off = 0; off < len; off += page)
+            (void)*(const volatile uint8_t *)(start + off);
+    }
+}
+
+// Submits the queued reads and waits for them, returns whether none are left
+// in flight
+static bool finish_reads(struct uring *ring)
+{
+    uring_submit(ring, true);
+    uint64_t data;
+    int32_t res;
+    while (uring_complete(ring, &data, &res))
+        ;
+    return uring_inflight(ring) == 0;
+}
+
+// A value being read into the buffer pool: the blocks holding its record
+struct block_read
+{
+    uint8_t *buf;
+    uint64_t start;
+    uint64_t size;
+    int64_t res;
+};
+
+// Puts the value read into the buffer pool, and points the view at it
+static void finish_load(struct db *db, struct db_view *view, const struct block_read *read)
+{
+    uint64_t rec = view->offset - REC_HDR_SIZE - read->start;
+    struct record hdr;
+    if (read->res < 0 || (uint64_t)read->res < rec + REC_HDR_SIZE)
+        goto error;
+    memcpy(&hdr, read->buf + rec, REC_HDR_SIZE); // NOLINT [C11 Annex K]
+    if (rec_len(hdr.vlen) != view->len || (uint64_t)read->res < rec + rec_size(hdr.vlen) ||
+        !record_intact(read->buf + rec, hdr.vlen))
+        goto error;
+
+    // NOTE: Values the pool doesn't take get a buffer of their own, which goes
+    // away once released
+    struct iovec iov = {read->buf + rec + REC_HDR_SIZE, view->len};
+    struct cache_entry *entry = cache_put(db->pool, view->position, &iov, 1, view->expires);
+    if (!entry)
+        entry = cache_copy(view->position, &iov, 1, view->expires);
+    if (!entry)
+        return;
+    db_release(view->pin);
+    view->pin = (void *)((uintptr_t)entry | PIN_BUFFER);
+    view->data = entry->data;
+    return;
+
+error:
+    fprintf(stderr, "DB: Failed to read the record at offset %lu\n", view->position);
+}
+
+// NOTE: Reads the values of the views without data into the buffer pool,
+// straight from the disk. With io_uring, up to a ring's worth of reads are
+// submitted together.
+static void load_views(struct db *db, struct db_view *const *views, uint32_t count)
+{
+    struct uring *ring = thread_ring(db);
+    struct block_read reads[RING_ENTRIES];
+    for (uint32_t first = 0; first < count; first += RING_ENTRIES) {
+        uint32_t n = (count - first < RING_ENTRIES) ? count - first : RING_ENTRIES;
+        for (uint32_t i = 0; i < n; i++) {
+            struct db_view *view = views[first + i];
+            struct block_read *read = &reads[i];
+            read->buf = NULL;
+            read->res = -1;
+            if (view->data)
+                continue;
+            uint64_t mask = (uint64_t)db->align - 1;
+            read->start = (view->offset - REC_HDR_SIZE) & ~mask;
+            read->size = ((view->offset + view->len + REC_CRC_SIZE + mask) & ~mask) - read->start;
+            read->buf = aligned_alloc(db->align, read->size);
+            if (!read->buf)
+                continue;
+            // The zone is pinned, its file stays open
+            int fd = zone_fd(db, zone_of(view->position));
+            if (ring) {
+                struct io_uring_sqe *sqe = uring_sqe(ring);
+                uring_prep(sqe, IORING_OP_READ, fd, read->buf, (uint32_t)read->size, read->start, i);
+            } else {
+                read->res = pread(fd, read->buf, read->size, (off_t)read->start);
             }
+        }
 
-            *vlen = rec.vlen;
-            ret = buf;
-            goto out;
+        if (ring) {
+            if (uring_submit(ring, true) != OK && uring_inflight(ring))
+                return; // The buffers may still be written to, leave them be
+            uint64_t i;
+            int32_t res;
+            while (uring_complete(ring, &i, &res))
+                reads[i].res = res;
         }
+        for (uint32_t i = 0; i < n; i++) {
+            if (reads[i].buf)
+                finish_load(db, views[first + i], &reads[i]);
+            free(reads[i].buf);
+        }
+    }
+}
 
-        if (rec.next != DBID_FREE) {
-            offset = rec.next;
-        } else {
-            break;
+void db_prefetch(struct db *db, struct db_view *const *views, uint32_t count)
+{
+    if (db->pool) {
+        load_views(db, views, count);
+        return;
+    }
+    struct uring *ring = thread_ring(db);
+    char *buf = ring ? malloc(PREFETCH_CHUNK) : NULL;
+    if (!buf) {
+        prefetch_views(views, count);
+        return;
+    }
+
+    // NOTE: The values are read into the page cache, where the mapping finds
+    // them, with all of the reads going out in one submission. What ends up in
+    // the buffer doesn't matter, so they all share it.
+    for (uint32_t i = 0; i < count; i++) {
+        const struct db_view *view = views[i];
+        for (uint32_t off = 0; off < view->len; off += PREFETCH_CHUNK) {
+            uint32_t len = (view->len - off < PREFETCH_CHUNK) ? view->len - off : PREFETCH_CHUNK;
+            struct io_uring_sqe *sqe = uring_sqe(ring);
+            if (!sqe) {
+                if (!finish_reads(ring))
+                    return; // The buffer may still be written to, leave it be
+                sqe = uring_sqe(ring);
+            }
+            uring_prep(sqe, IORING_OP_READ, view->fd, buf, len, view->offset + off, 0);
         }
     }
-out:
-    pthread_rwlock_unlock(&db->lock);
-    return ret;
+    if (finish_reads(ring))
+        free(buf);
 }
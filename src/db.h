@@ -7,14 +7,122 @@ struct db;
 
 typedef uint64_t dbid_t;
 
+enum db_durability
+{
+    // Writes are left to the page cache
+    DB_DURABILITY_NONE,
+    // Concurrent inserts are written and synced together, an insert returns once its batch is synced
+    DB_DURABILITY_GROUP,
+    // Every insert is written and synced on its own
+    DB_DURABILITY_ALWAYS
+};
+
+// How a value is stored
+enum db_codec
+{
+    DB_CODEC_NONE,
+    // gzip stream, can be sent as is with Content-Encoding: gzip
+    DB_CODEC_GZIP
+};
+
 struct db_params
 {
-    size_t num_buckets;
+    // Initial number of index entries
+    size_t capacity;
+    enum db_durability durability;
+    // NOTE: Microseconds. How long a group commit waits for more inserts to
+    // join the batch, when the previous batch had more than one.
+    uint32_t commit_window;
+    // zlib compression level (1-9) for new values, 0 stores them uncompressed.
+    // Values that don't shrink by at least an eighth are stored uncompressed.
+    int compression;
+    // Store values equal to an earlier one only once
+    bool dedup;
+    // Back the index mapping with transparent huge pages, where the file
+    // system of the index supports them
+    bool huge_pages;
+    // Read the whole index in and map it on open, rather than on first use
+    bool prefault;
+    // NOTE: Bytes. Values up to this size, as stored, are also copied into
+    // their index entries, and read from there. Capped at 40.
+    uint32_t inline_max;
+    // NOTE: Seconds between compaction passes, 0 disables compaction. A pass
+    // drops expired values, and reclaims their space by moving the values
+    // left around them. That is limited to compact_rate bytes per second.
+    uint32_t compact_interval;
+    uint64_t compact_rate;
+    // NOTE: Seconds between index snapshots, 0 only takes one on close. After
+    // a crash, the index is restored from the last snapshot, and only the log
+    // written after it is scanned.
+    uint32_t snapshot_interval;
+    // Do reads, writes and syncs through io_uring, where the kernel has it
+    bool io_uring;
+    // NOTE: Bytes. If set, segments are written and read with O_DIRECT, past
+    // the page cache, and values are kept in a buffer pool of this size
+    // instead. Records are padded to the block size of the file system.
+    size_t buffer_pool;
+};
+
+// A value stored in the database. The data is borrowed from the database
+// mapping, the buffer pool in direct mode, or the index for small values, and
+// stays valid until it is released with db_release(pin), even if compaction
+// moves the value meanwhile. It is the value as stored, i.e. compressed if
+// codec says so.
+struct db_view
+{
+    const void *data;
+    uint32_t len;
+    enum db_codec codec;
+    // Unix time the value expires at, zero if it doesn't
+    uint64_t expires;
+    // Location of the value in the database file, e.g. for sendfile. The fd
+    // is -1 in direct mode, where the file bypasses the page cache.
+    int fd;
+    uint64_t offset;
+    // Position of the record in the database
+    uint64_t position;
+    void *pin;
+};
+
+struct db_stats
+{
+    // Number of ids handed out
+    uint64_t count;
+    // Number of index entries
+    uint64_t capacity;
+    // Inserts that found an equal value already stored
+    uint64_t dedup_hits;
+    // Values dropped from the index once expired
+    uint64_t expired;
+    // Bytes of the database file reclaimed by compaction
+    uint64_t reclaimed;
 };
 
 struct db *open_db(const char *path, const struct db_params *params);
 void close_db(struct db *db);
-int db_insert(struct db *db, const void *val, uint32_t vlen, dbid_t *result);
-void *db_get(struct db *db, dbid_t id, uint32_t *vlen);
+// NOTE: The value expires after ttl seconds, or never if ttl is 0. Expired
+// values are gone for db_get right away, their space is reclaimed later.
+int db_insert(struct db *db, const void *val, uint32_t vlen, uint32_t ttl, dbid_t *result);
+// NOTE: In direct mode, the data of a value that isn't in the buffer pool is
+// NULL, until db_prefetch reads it in. Values copied into the index always
+// have data, and no fd.
+int db_get(struct db *db, dbid_t id, struct db_view *view);
+// Releases a value returned by db_get
+void db_release(void *pin);
+// NOTE: Size of the value once decoded. Reads the value if it is compressed.
+uint32_t db_size(const struct db_view *view);
+// Decodes the value into out, which must hold db_size(view) bytes
+int db_decode(const struct db_view *view, void *out);
+// Whether the value is in memory, i.e. reading or sending it won't wait for the disk
+bool db_resident(const struct db_view *view);
+// NOTE: Reads the values into memory. Waits for the disk if they aren't, so it
+// is best called off the event loops. With io_uring, the reads of all of them
+// are submitted together. In direct mode, a value that can't be read is left
+// without data.
+void db_prefetch(struct db *db, struct db_view *const *views, uint32_t count);
+// NOTE: Grows the index to the given capacity. The index only ever grows, so
+// smaller capacities fail. The database stays usable meanwhile.
+int db_resize(struct db *db, uint64_t capacity);
+void db_stats(struct db *db, struct db_stats *stats);
 
 #endif
@@ -1,16 +1,93 @@
 #include "event.h"
 #include "rbtree.h"
+#include "uring.h"
 #include "util.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #define MAX_IO_EVENTS 64
-#define IO_TIMEOUT 10
+
+// NOTE: With io_uring, each base has a ring of this many entries, and receives
+// go to this many buffers of this size, shared by all of its connections
+#define RING_ENTRIES 256
+#define MAX_COMPLETIONS 256
+#define RECV_GROUP 0
+#define RECV_BUFS 128
+#define RECV_BUF_SIZE 16384
+// Waits (in milliseconds) for what is in flight to be cancelled, on destroy
+#define DRAIN_TIMEOUT 100
+#define DRAIN_TRIES 20
+#define NO_OP UINT32_MAX
+
+enum op_kind
+{
+    OP_POLL,
+    OP_SEND,
+    // Multishot, see complete_op
+    OP_POLL_MULTI,
+    OP_ACCEPT,
+    OP_RECV
+};
+
+// NOTE: A request in flight on the ring. Its user data is the index of its
+// slot, and the generation of the slot, bumped whenever it is taken. That way
+// the completions of a request whose event is gone, or a cancel that comes too
+// late, never reach whatever the slot has been reused for.
+struct op
+{
+    // NULL once deleted, the slot is freed with the last completion
+    struct event *event;
+    uint32_t gen;
+    enum op_kind kind;
+    // Next free slot
+    uint32_t next;
+};
+
+// NOTE: The timing wheel ticks every millisecond. Each level has 64 slots, a
+// slot of a level spanning all of the level below it. Six levels cover 2^36
+// milliseconds, past the longest timer interval.
+#define NS_PER_TICK 1000000ULL
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 6
+
+// NOTE: A timer due at tick t goes to the level of the highest bit t differs
+// in from the current tick, and the slot of t's digit in that level. Once the
+// levels below it wrap around to that slot, its timers are spread over them
+// again, and reach the first level just in time.
+struct timer_wheel
+{
+    // Last tick the timers have run for
+    uint64_t now;
+    uint32_t count;
+    struct list slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
 
 struct event_base
 {
     int epollfd;
+    // NULL with epoll
+    struct uring *ring;
+    struct uring_bufs *bufs;
+    struct op *ops;
+    uint32_t num_ops;
+    uint32_t free_op;
+    // Slots taken, including ones deleted and waiting for their last completion
+    uint32_t live_ops;
+    enum event_timers kind;
     struct rbtree timers;
+    struct timer_wheel wheel;
+    volatile uint64_t syscalls;
+    // Nanoseconds to spin for I/O before going to sleep, 0 never spins
+    uint64_t busy_poll;
+    // See wake_event_base
+    int wakefd;
+    struct event wake;
 };
 
 static inline void update_trigger(struct timer *t)
@@ -23,91 +100,536 @@ static inline int timer_cmp(const struct rbnode *a, const struct rbnode *b)
 {
     const struct timer *tima = (const struct timer *)a;
     const struct timer *timb = (const struct timer *)b;
-    if (tima->trigger < timb->trigger) {
+    if (tima->filed < timb->filed) {
         return -1;
-    } else if (tima->trigger == timb->trigger) {
+    } else if (tima->filed == timb->filed) {
         return 0;
     } else {
         return 1;
     }
 }
 
-static void run_timers(struct event_base *base)
+// Tick the timer is due at
+static inline uint64_t due_tick(const struct timer *t)
+{
+    return (t->trigger + NS_PER_TICK - 1) / NS_PER_TICK;
+}
+
+// Links the timer into the slot of its deadline, which is no earlier than the
+// given tick
+static void wheel_insert(struct timer_wheel *wheel, struct timer *t, uint64_t earliest)
+{
+    uint64_t due = due_tick(t);
+    if (due < earliest)
+        due = earliest;
+    uint64_t diff = due ^ wheel->now;
+    int level = diff ? (63 - __builtin_clzll(diff)) / WHEEL_BITS : 0;
+    if (level >= WHEEL_LEVELS)
+        level = WHEEL_LEVELS - 1;
+    struct list *slot = &wheel->slots[level][(due >> (level * WHEEL_BITS)) & WHEEL_MASK];
+    list_add_tail(slot, &t->link);
+}
+
+// Moves the timers of the slot over to the list
+static void take_slot(struct list *slot, struct list *out)
+{
+    LIST_INIT_HEAD(*out);
+    if (!LIST_HEAD(slot))
+        return;
+    out->next = slot->next;
+    out->prev = slot->prev;
+    out->next->prev = out;
+    out->prev->next = out;
+    LIST_INIT_HEAD(*slot);
+}
+
+// Spreads the timers of the current slot of the level over the levels below
+static void wheel_cascade(struct timer_wheel *wheel, int level)
+{
+    struct list timers;
+    take_slot(&wheel->slots[level][(wheel->now >> (level * WHEEL_BITS)) & WHEEL_MASK], &timers);
+    struct list *iter, *next;
+    list_for_each_safe(iter, next, &timers) {
+        list_del(iter);
+        wheel_insert(wheel, list_entry(iter, struct timer, link), wheel->now);
+    }
+}
+
+// NOTE: Tick of the first slot ahead with timers, either due then or to be
+// spread over the levels below. A level never has timers in its current slot,
+// and the levels below are done with theirs before the next slot comes up.
+static uint64_t wheel_next(const struct timer_wheel *wheel)
+{
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t pos = wheel->now >> (level * WHEEL_BITS);
+        for (uint64_t i = 1; i < WHEEL_SLOTS; i++) {
+            if (LIST_HEAD(&wheel->slots[level][(pos + i) & WHEEL_MASK]))
+                return (pos + i) << (level * WHEEL_BITS);
+        }
+    }
+    return wheel->now + 1;
+}
+
+// NOTE: This is in reverse order -- first delete/update the timer, and then call the callback
+// This is done, because the timer structure might be freed in the callback, and after that it
+// becomes inaccessible.
+static void fire_timer(struct event_base *base, struct timer *t)
+{
+    del_timer(base, t);
+    if (!(t->flags & TIMER_FLAG_ONESHOT))
+        add_timer(base, t);
+
+    assert(t->cb);
+    t->cb(t->data);
+}
+
+static void run_tree(struct event_base *base)
 {
     struct rbtree *tree = &base->timers;
     uint64_t now = get_time();
     while (1) {
-        struct timer *t = (struct timer *)rbtree_leftmost(tree->root);
-        if (!t) break;
-        if (now >= t->trigger) {
-            if (t->flags & TIMER_FLAG_ACTIVE) {
-                // NOTE: This is in reverse order -- first delete/update the timer, and then call the callback
-                // This is done, because the timer structure might be freed in the callback, and after that it
-                // becomes inaccessible.
-                if (t->flags & TIMER_FLAG_ONESHOT) {
-                    del_timer(base, t);
-                } else {
-                    update_trigger(t);
-                }
-
-                assert(t->cb);
-                t->cb(t->data);
-            } else {
-                del_timer(base, t);
-            }
+        struct timer *t = (struct timer *)rbtree_leftmost(tree, tree->root);
+        if (!t || now < t->filed)
+            break;
+        if (now < t->trigger) {
+            // Touched since it was filed
+            rbtree_delete(tree, &t->node);
+            t->filed = t->trigger;
+            rbtree_insert(tree, &t->node);
+            continue;
+        }
+        fire_timer(base, t);
+    }
+}
 
-        } else {
+// Steps the wheel tick by tick up to now, running the timers due. An empty
+// wheel skips ahead.
+static void run_wheel(struct event_base *base)
+{
+    struct timer_wheel *wheel = &base->wheel;
+    uint64_t now = get_time() / NS_PER_TICK;
+    while (wheel->now < now) {
+        if (!wheel->count) {
+            wheel->now = now;
             break;
         }
+        wheel->now++;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->now & ((1ULL << (level * WHEEL_BITS)) - 1))
+                break;
+            wheel_cascade(wheel, level);
+        }
+
+        // Timers deleted by the callbacks leave the list, and new ones are
+        // never due at the current tick. Ones touched since they were linked
+        // in are moved to their new slot.
+        struct list due;
+        take_slot(&wheel->slots[0][wheel->now & WHEEL_MASK], &due);
+        struct list *iter;
+        while ((iter = LIST_HEAD(&due))) {
+            struct timer *t = list_entry(iter, struct timer, link);
+            if (due_tick(t) > wheel->now) {
+                list_del(iter);
+                wheel_insert(wheel, t, wheel->now + 1);
+                continue;
+            }
+            fire_timer(base, t);
+        }
+    }
+}
+
+static void run_timers(struct event_base *base)
+{
+    if (base->kind == EVENT_TIMERS_WHEEL)
+        run_wheel(base);
+    else
+        run_tree(base);
+}
+
+// Milliseconds until the next timer is due, rounded up, -1 if there is none
+static int next_timeout(struct event_base *base)
+{
+    uint64_t deadline;
+    if (base->kind == EVENT_TIMERS_WHEEL) {
+        if (!base->wheel.count)
+            return -1;
+        deadline = wheel_next(&base->wheel) * NS_PER_TICK;
+    } else {
+        struct timer *t = (struct timer *)rbtree_leftmost(&base->timers, base->timers.root);
+        if (!t)
+            return -1;
+        // Touched timers are only looked at again then
+        deadline = t->filed;
     }
+
+    uint64_t now = get_time();
+    if (deadline <= now)
+        return 0;
+    uint64_t ms = (deadline - now + 999999) / 1000000;
+    return (ms > INT_MAX) ? INT_MAX : (int)ms;
 }
 
+// Returns the number of events handled, or ERR
 static int run_io(struct event_base *base, int timeout)
 {
     struct epoll_event events[MAX_IO_EVENTS];
     int n = epoll_wait(base->epollfd, events, MAX_IO_EVENTS, timeout);
-    if (n) {
-        for (int i = 0; i < n; i++) {
-            struct event *event = events[i].data.ptr;
-            assert(event->cb);
-            event->cb(event->fd, events[i].events, event->data);
+    base->syscalls++;
+    if (n < 0)
+        return (errno == EINTR) ? 0 : ERR;
+    for (int i = 0; i < n; i++) {
+        struct event *event = events[i].data.ptr;
+        assert(event->cb);
+        event->cb(event->fd, events[i].events, event->data);
+    }
+    return n;
+}
+
+static struct io_uring_sqe *get_sqe(struct event_base *base)
+{
+    struct io_uring_sqe *sqe = uring_sqe(base->ring);
+    if (!sqe) {
+        // Full, hand what is queued to the kernel first
+        base->syscalls++;
+        uring_flush(base->ring, 0);
+        sqe = uring_sqe(base->ring);
+    }
+    return sqe;
+}
+
+static uint32_t alloc_op(struct event_base *base)
+{
+    if (base->free_op == NO_OP) {
+        uint32_t num = base->num_ops ? base->num_ops * 2 : RING_ENTRIES;
+        struct op *ops = realloc(base->ops, num * sizeof *ops);
+        if (!ops)
+            return NO_OP;
+        for (uint32_t i = base->num_ops; i < num; i++) {
+            ops[i].event = NULL;
+            ops[i].gen = 0;
+            ops[i].next = (i + 1 < num) ? i + 1 : NO_OP;
+        }
+        base->free_op = base->num_ops;
+        base->ops = ops;
+        base->num_ops = num;
+    }
+    uint32_t index = base->free_op;
+    struct op *op = &base->ops[index];
+    base->free_op = op->next;
+    op->gen++;
+    base->live_ops++;
+    return index;
+}
+
+static void free_op(struct event_base *base, uint32_t index)
+{
+    struct op *op = &base->ops[index];
+    op->event = NULL;
+    op->next = base->free_op;
+    base->free_op = index;
+    base->live_ops--;
+}
+
+static inline uint64_t op_data(const struct event_base *base, uint32_t index)
+{
+    return ((uint64_t)base->ops[index].gen << 32) | index;
+}
+
+// Fills in the request of an operation other than a send
+static void prep_op(struct event_base *base, struct io_uring_sqe *sqe, uint32_t index)
+{
+    const struct op *op = &base->ops[index];
+    int fd = op->event->fd;
+    uint64_t data = op_data(base, index);
+    switch (op->kind) {
+        case OP_POLL:
+        case OP_POLL_MULTI: {
+            uring_prep(sqe, IORING_OP_POLL_ADD, fd, NULL,
+                       (op->kind == OP_POLL_MULTI) ? IORING_POLL_ADD_MULTI : 0, 0, data);
+            sqe->poll32_events = op->event->events;
+        } break;
+
+        case OP_ACCEPT: {
+            uring_prep(sqe, IORING_OP_ACCEPT, fd, NULL, 0, 0, data);
+            sqe->accept_flags = SOCK_NONBLOCK|SOCK_CLOEXEC;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        } break;
+
+        case OP_RECV: {
+            uring_prep(sqe, IORING_OP_RECV, fd, NULL, 0, 0, data);
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = RECV_GROUP;
+        } break;
+
+        case OP_SEND:
+        default: { // NOLINT
+            uring_prep(sqe, IORING_OP_NOP, -1, NULL, 0, 0, data);
+        } break;
+    }
+}
+
+static struct io_uring_sqe *start_op(struct event_base *base, struct event *event, enum op_kind kind)
+{
+    if (!base->ring || (event->flags & EVENT_FLAG_ACTIVE))
+        return NULL;
+    uint32_t index = alloc_op(base);
+    if (index == NO_OP)
+        return NULL;
+    struct io_uring_sqe *sqe = get_sqe(base);
+    if (!sqe) {
+        free_op(base, index);
+        return NULL;
+    }
+
+    struct op *op = &base->ops[index];
+    op->event = event;
+    op->kind = kind;
+    event->op = index;
+    event->flags |= EVENT_FLAG_ACTIVE;
+    prep_op(base, sqe, index);
+    return sqe;
+}
+
+static int queue_cancel(struct event_base *base, uint32_t index)
+{
+    struct io_uring_sqe *sqe = get_sqe(base);
+    if (!sqe)
+        return ERR;
+    uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, 0);
+    sqe->addr = op_data(base, index);
+    return OK;
+}
+
+// NOTE: A multishot operation may stop while its event still wants it, when
+// the completion queue overflows, or there are no buffers left for a receive.
+// It is then started again, in the same slot, once its callback is done.
+static void complete_op(struct event_base *base, uint64_t user_data, int32_t res, uint32_t flags)
+{
+    // Cancels and closes have no slot
+    uint32_t index = (uint32_t)user_data;
+    if (!(user_data >> 32) || index >= base->num_ops || base->ops[index].gen != (uint32_t)(user_data >> 32))
+        return;
+
+    struct op *op = &base->ops[index];
+    struct event *event = op->event;
+    const char *data = NULL;
+    uint16_t buf = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        buf = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+        data = uring_buf(base->bufs, buf);
+    }
+
+    bool restart = false;
+    if (!(flags & IORING_CQE_F_MORE)) {
+        if (event && op->kind >= OP_POLL_MULTI)
+            restart = (res == -ENOBUFS) || (res > 0) || (res == 0 && op->kind == OP_ACCEPT);
+        if (!restart) {
+            if (event)
+                event->flags &= ~EVENT_FLAG_ACTIVE;
+            free_op(base, index);
+        }
+    }
+
+    // NOTE: The callback may free the event
+    if (event && res != -ENOBUFS) {
+        if (event->done)
+            event->done(res, data, event->data);
+        else
+            event->cb(event->fd, (res < 0) ? EPOLLERR : (uint32_t)res, event->data);
+    }
+    if (data)
+        uring_put_buf(base->bufs, buf);
+
+    if (restart) {
+        // Unless deleted by the callback
+        op = &base->ops[index];
+        struct io_uring_sqe *sqe = op->event ? get_sqe(base) : NULL;
+        if (sqe) {
+            prep_op(base, sqe, index);
+        } else {
+            if (op->event)
+                op->event->flags &= ~EVENT_FLAG_ACTIVE;
+            free_op(base, index);
         }
-    } else if (n < 0) {
+    }
+}
+
+// Submits what is queued, waits for completions and runs their callbacks, in
+// one system call. Returns the number of completions, or ERR.
+static int run_ring(struct event_base *base, int timeout)
+{
+    // Without anything to submit or wait for, the completion queue is only
+    // looked at, which needs no system call
+    if (timeout || uring_queued(base->ring)) {
+        base->syscalls++;
+        if (uring_flush(base->ring, timeout) != OK)
+            return ERR;
+    }
+
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+    int n = 0;
+    for (; n < MAX_COMPLETIONS; n++) {
+        if (!uring_complete_flags(base->ring, &user_data, &res, &flags))
+            break;
+        complete_op(base, user_data, res, flags);
+    }
+    return n;
+}
+
+// NOTE: Besides the ring, needs multishot accept and receive (Linux 6.0), and
+// rings of provided buffers
+static int create_ring(struct event_base *base)
+{
+    base->ring = create_uring(RING_ENTRIES);
+    if (!base->ring)
         return ERR;
+    if (!(uring_features(base->ring) & IORING_FEAT_EXT_ARG)) {
+        errno = ENOSYS;
+        goto error;
     }
+    base->bufs = create_uring_bufs(base->ring, RECV_GROUP, RECV_BUFS, RECV_BUF_SIZE);
+    if (!base->bufs)
+        goto error;
+    base->free_op = NO_OP;
     return OK;
+
+error:;
+    int err = errno;
+    destroy_uring(base->ring);
+    base->ring = NULL;
+    errno = err;
+    return ERR;
+}
+
+static void destroy_ring(struct event_base *base)
+{
+    // Whatever is still in flight completes with -ECANCELED, so that its owner
+    // can let go of the memory it uses
+    struct io_uring_sqe *sqe = get_sqe(base);
+    if (sqe) {
+        uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, 0);
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+    for (int i = 0; base->live_ops && i < DRAIN_TRIES; i++) {
+        if (run_ring(base, DRAIN_TIMEOUT) < 0)
+            break;
+    }
+
+    destroy_uring(base->ring);
+    destroy_uring_bufs(base->bufs);
+    free(base->ops);
+}
+
+static void on_wake(int fd, uint32_t events, void *data)
+{
+    UNUSED(events);
+    struct event_base *base = data;
+    uint64_t count;
+    base->syscalls++;
+    if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+        perror("Event: eventfd read");
 }
 
-struct event_base *create_event_base(void)
+// Waits for I/O on whichever backend, returns the number of events handled
+static int wait_io(struct event_base *base, int timeout)
+{
+    if (base->ring)
+        return run_ring(base, timeout);
+    return run_io(base, timeout);
+}
+
+struct event_base *create_event_base(enum event_backend backend, enum event_timers timers,
+                                     uint32_t busy_poll)
 {
     struct event_base *base = calloc(1, sizeof *base);
     if (base) {
+        base->kind = timers;
+        base->busy_poll = (uint64_t)busy_poll * 1000ULL;
         rbtree_init(&base->timers, sizeof(struct timer), timer_cmp);
-        int epollfd = epoll_create1(0);
-        if (epollfd >= 0)
-            base->epollfd = epollfd;
+        base->wheel.now = get_time() / NS_PER_TICK;
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+                LIST_INIT_HEAD(base->wheel.slots[level][slot]);
+        }
+        base->epollfd = -1;
+        if (backend == EVENT_BACKEND_URING && create_ring(base) != OK)
+            fprintf(stderr, "Event: io_uring is not available (%s), using epoll\n", strerror(errno));
+        if (!base->ring) {
+            int epollfd = epoll_create1(0);
+            if (epollfd >= 0)
+                base->epollfd = epollfd;
+        }
+
+        base->wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        base->wake = make_event(base->wakefd, EPOLLIN|EPOLLET, on_wake, base);
+        if (base->wakefd < 0 || add_event(base, &base->wake) != OK) {
+            perror("Event: eventfd");
+            if (base->wakefd >= 0)
+                close(base->wakefd);
+            base->wakefd = -1;
+            destroy_event_base(base);
+            return NULL;
+        }
     }
     return base;
 }
 
 void destroy_event_base(struct event_base *base)
 {
+    if (base->wakefd >= 0) {
+        del_event(base, &base->wake);
+        close(base->wakefd);
+    }
+    if (base->ring)
+        destroy_ring(base);
     if (base->epollfd >= 0)
         close(base->epollfd);
     free(base);
 }
 
+// NOTE: Sleeps until there is I/O, or the next timer is due. With busy polling,
+// first spins for the budget (though not past the timer), trading a core for
+// the latency of waking up: epoll is polled without waiting, and with io_uring
+// the completion queue is watched without entering the kernel at all.
 int event_base_iter(struct event_base *base)
 {
     run_timers(base);
-    return run_io(base, IO_TIMEOUT);
+    int timeout = next_timeout(base);
+    if (base->busy_poll && timeout) {
+        uint64_t spin = base->busy_poll;
+        if (timeout > 0 && (uint64_t)timeout * 1000000ULL < spin)
+            spin = (uint64_t)timeout * 1000000ULL;
+        uint64_t until = get_time() + spin;
+        do {
+            int n = wait_io(base, 0);
+            if (n)
+                return (n < 0) ? ERR : OK;
+        } while (get_time() < until);
+        timeout = next_timeout(base);
+    }
+    return (wait_io(base, timeout) < 0) ? ERR : OK;
+}
+
+int wake_event_base(struct event_base *base)
+{
+    uint64_t one = 1;
+    if (write(base->wakefd, &one, sizeof one) != sizeof one)
+        return ERR;
+    return OK;
 }
 
 int add_event(struct event_base *base, struct event *event)
 {
+    if (base->ring)
+        return start_op(base, event, OP_POLL_MULTI) ? OK : ERR;
+
     struct epoll_event e;
     e.events = event->events;
     e.data.ptr = event;
+    base->syscalls++;
     if (epoll_ctl(base->epollfd, EPOLL_CTL_ADD, event->fd, &e))
         return ERR;
     event->flags |= EVENT_FLAG_ACTIVE;
@@ -116,9 +638,18 @@ int add_event(struct event_base *base, struct event *event)
 
 int del_event(struct event_base *base, struct event *event)
 {
+    if (base->ring) {
+        if (!(event->flags & EVENT_FLAG_ACTIVE))
+            return ERR;
+        event->flags &= ~EVENT_FLAG_ACTIVE;
+        base->ops[event->op].event = NULL;
+        return queue_cancel(base, event->op);
+    }
+
     // For really old kernels, this is necessary.
     // See man epoll_ctl, section "BUGS"
     struct epoll_event e = {0};
+    base->syscalls++;
     if (epoll_ctl(base->epollfd, EPOLL_CTL_DEL, event->fd, &e))
         return ERR;
     event->flags &= ~EVENT_FLAG_ACTIVE;
@@ -132,16 +663,94 @@ int add_timer(struct event_base *base, struct timer *timer)
 
     update_trigger(timer);
     timer->flags |= TIMER_FLAG_ACTIVE;
-    rbtree_insert(&base->timers, &timer->node);
+    if (base->kind == EVENT_TIMERS_WHEEL) {
+        // The slot of the current tick has already run
+        wheel_insert(&base->wheel, timer, base->wheel.now + 1);
+        base->wheel.count++;
+    } else {
+        timer->filed = timer->trigger;
+        rbtree_insert(&base->timers, &timer->node);
+    }
     return OK;
 }
 
 int del_timer(struct event_base *base, struct timer *timer)
 {
     if (timer->flags & TIMER_FLAG_ACTIVE) {
-        rbtree_delete(&base->timers, &timer->node);
+        if (base->kind == EVENT_TIMERS_WHEEL) {
+            list_del(&timer->link);
+            base->wheel.count--;
+        } else {
+            rbtree_delete(&base->timers, &timer->node);
+        }
         timer->flags &= ~TIMER_FLAG_ACTIVE;
         return OK;
     }
     return ERR;
 }
+
+int touch_timer(struct event_base *base, struct timer *timer)
+{
+    if (!(timer->flags & TIMER_FLAG_ACTIVE))
+        return add_timer(base, timer);
+    update_trigger(timer);
+    return OK;
+}
+
+void count_syscalls(struct event_base *base, uint32_t n)
+{
+    base->syscalls += n;
+}
+
+uint64_t event_base_syscalls(const struct event_base *base)
+{
+    return base->syscalls;
+}
+
+bool event_base_ops(const struct event_base *base)
+{
+    return base->ring != NULL;
+}
+
+int submit_accept(struct event_base *base, struct event *event)
+{
+    return start_op(base, event, OP_ACCEPT) ? OK : ERR;
+}
+
+int submit_recv(struct event_base *base, struct event *event)
+{
+    return start_op(base, event, OP_RECV) ? OK : ERR;
+}
+
+int submit_send(struct event_base *base, struct event *event, const struct msghdr *msg, int flags)
+{
+    struct io_uring_sqe *sqe = start_op(base, event, OP_SEND);
+    if (!sqe)
+        return ERR;
+    uring_prep(sqe, IORING_OP_SENDMSG, event->fd, msg, 1, 0, op_data(base, event->op));
+    sqe->msg_flags = (uint32_t)flags;
+    return OK;
+}
+
+int submit_poll(struct event_base *base, struct event *event)
+{
+    return start_op(base, event, OP_POLL) ? OK : ERR;
+}
+
+int cancel_op(struct event_base *base, struct event *event)
+{
+    if (!base->ring || !(event->flags & EVENT_FLAG_ACTIVE))
+        return ERR;
+    return queue_cancel(base, event->op);
+}
+
+int submit_close(struct event_base *base, int fd)
+{
+    struct io_uring_sqe *sqe = base->ring ? get_sqe(base) : NULL;
+    if (!sqe) {
+        base->syscalls++;
+        return close(fd) ? ERR : OK;
+    }
+    uring_prep(sqe, IORING_OP_CLOSE, fd, NULL, 0, 0, 0);
+    return OK;
+}
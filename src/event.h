@@ -5,30 +5,64 @@
 #include "list.h"
 #include "rbtree.h"
 #include <sys/epoll.h>
+#include <sys/socket.h>
 
 struct event_base;
 
 typedef void (*event_callback)(int, uint32_t, void *);
+// NOTE: Result of an operation, see submit_accept and below
+typedef void (*completion_callback)(int32_t, const char *, void *);
 typedef void (*timer_callback)(void *);
 
 #define EVENT_FLAG_ACTIVE (1 << 0)
 
+// How an event base waits for I/O
+enum event_backend
+{
+    // Readiness of the fds through epoll, their owners do the I/O
+    EVENT_BACKEND_EPOLL,
+    // io_uring. Waits for readiness through polls, and can also do the I/O
+    // itself, batching it into the system call that waits.
+    EVENT_BACKEND_URING
+};
+
 struct event
 {
     int fd;
     uint32_t events;
     int flags;
     event_callback cb;
+    // Called instead of cb for an operation
+    completion_callback done;
     void *data;
+    // io_uring only: Request in flight for the event
+    uint32_t op;
 };
 
 #define TIMER_FLAG_ACTIVE (1 << 0)
 #define TIMER_FLAG_ONESHOT (1 << 1)
 
+// How an event base keeps its timers
+enum event_timers
+{
+    // Red-black tree ordered by deadline, O(log n) add and delete
+    EVENT_TIMERS_TREE,
+    // Hierarchical timing wheel with millisecond ticks, O(1) add and delete
+    EVENT_TIMERS_WHEEL
+};
+
 struct timer
 {
-    struct rbnode node;
+    // NOTE: Must come first, the tree compares nodes as timers
+    union {
+        struct rbnode node;
+        // Slot of the timing wheel
+        struct list link;
+    };
     uint64_t trigger;
+    // NOTE: Deadline the timer is filed under in the tree. A touched timer
+    // triggers later than that, and is only refiled once this passes.
+    uint64_t filed;
     uint32_t interval;
     int flags;
     timer_callback cb;
@@ -45,6 +79,15 @@ static inline struct event make_event(int fd, uint32_t events, event_callback cb
     return event;
 }
 
+static inline struct event make_op(int fd, completion_callback done, void *data)
+{
+    struct event event = {0};
+    event.fd = fd;
+    event.done = done;
+    event.data = data;
+    return event;
+}
+
 // NOTE: Interval is in milliseconds
 static inline struct timer make_timer(uint32_t interval, int mode, timer_callback cb, void *data)
 {
@@ -56,12 +99,52 @@ static inline struct timer make_timer(uint32_t interval, int mode, timer_callbac
     return timer;
 }
 
-struct event_base *create_event_base(void);
+// NOTE: Falls back to epoll if the kernel lacks what the io_uring backend needs.
+// Busy polling is in microseconds, see event_base_iter.
+struct event_base *create_event_base(enum event_backend backend, enum event_timers timers,
+                                     uint32_t busy_poll);
 void destroy_event_base(struct event_base *base);
 int event_base_iter(struct event_base *base);
+// NOTE: Safe from any thread. Makes the current (or next) event_base_iter
+// return without waiting, as it might otherwise sleep until the next timer.
+int wake_event_base(struct event_base *base);
 int add_event(struct event_base *base, struct event *event);
+// NOTE: With io_uring, also cancels the operation of the event. Its callback
+// isn't called anymore, though whatever the operation uses has to stay intact
+// until the base is destroyed (or a later close of the fd with submit_close).
 int del_event(struct event_base *base, struct event *event);
+
+// NOTE: Operations, only with the io_uring backend (event_base_ops). The event
+// is active from submission until its last completion, and has at most one
+// operation in flight. The callback gets the result, the number of bytes or a
+// negative errno, and for a receive the data, which is only valid during the
+// call. Operations are handed to the kernel the next time the base waits.
+bool event_base_ops(const struct event_base *base);
+// Multishot: completes with each connection accepted on the listening socket,
+// non-blocking, and stays active until an error
+int submit_accept(struct event_base *base, struct event *event);
+// Multishot: completes with the data whenever some arrives, into buffers of the
+// base, and with 0 at the end of the stream
+int submit_recv(struct event_base *base, struct event *event);
+// The message has to stay intact until the next wait, the data it points to
+// until completion
+int submit_send(struct event_base *base, struct event *event, const struct msghdr *msg, int flags);
+// Completes once the fd is ready for the events of the event, with those ready
+int submit_poll(struct event_base *base, struct event *event);
+// Makes the operation complete early, with -ECANCELED if it hadn't already
+int cancel_op(struct event_base *base, struct event *event);
+// NOTE: Closes the fd once the operations submitted before are done with it,
+// so the number can't be reused under them
+int submit_close(struct event_base *base, int fd);
 int add_timer(struct event_base *base, struct timer *timer);
 int del_timer(struct event_base *base, struct timer *timer);
+// NOTE: Pushes the deadline of an active timer back by its interval, without
+// moving it: that happens once the old deadline comes. Adds an inactive one.
+int touch_timer(struct event_base *base, struct timer *timer);
+// NOTE: System calls made on the thread of the base, by the base itself and,
+// through count_syscalls, by its callers. Only meant for monitoring, it is read
+// from other threads without synchronization.
+void count_syscalls(struct event_base *base, uint32_t n);
+uint64_t event_base_syscalls(const struct event_base *base);
 
 #endif
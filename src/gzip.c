@@ -0,0 +1,55 @@
+#include "gzip.h"
+#include <zlib.h>
+
+// Window size, plus 16 to have zlib write and expect a gzip header and trailer
+#define GZIP_WINDOW_BITS (15 + 16)
+#define GZIP_MEM_LEVEL 8
+#define GZIP_TRAILER_SIZE 8
+
+size_t gzip_bound(size_t len)
+{
+    // compressBound accounts for the zlib wrapper, the gzip one is 12 bytes larger
+    return compressBound(len) + 12;
+}
+
+int gzip_compress(const void *src, size_t len, void *dst, size_t *dstlen, int level)
+{
+    z_stream zs = {0};
+    if (deflateInit2(&zs, level, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+        return ERR;
+
+    zs.next_in = (Bytef *)(uintptr_t)src;
+    zs.avail_in = (uInt)len;
+    zs.next_out = dst;
+    zs.avail_out = (uInt)*dstlen;
+    int ret = deflate(&zs, Z_FINISH);
+    *dstlen = zs.total_out;
+    deflateEnd(&zs);
+    return (ret == Z_STREAM_END) ? OK : ERR;
+}
+
+int gzip_decompress(const void *src, size_t len, void *dst, size_t dstlen)
+{
+    z_stream zs = {0};
+    if (inflateInit2(&zs, GZIP_WINDOW_BITS) != Z_OK)
+        return ERR;
+
+    zs.next_in = (Bytef *)(uintptr_t)src;
+    zs.avail_in = (uInt)len;
+    zs.next_out = dst;
+    zs.avail_out = (uInt)dstlen;
+    int ret = inflate(&zs, Z_FINISH);
+    size_t total = zs.total_out;
+    inflateEnd(&zs);
+    return (ret == Z_STREAM_END && total == dstlen) ? OK : ERR;
+}
+
+uint32_t gzip_size(const void *src, size_t len)
+{
+    if (len < GZIP_TRAILER_SIZE)
+        return 0;
+
+    // The trailer is the CRC32 of the data followed by its size, little endian
+    const uint8_t *p = (const uint8_t *)src + len - 4;
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
@@ -0,0 +1,19 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include "common.h"
+
+// Thin wrappers around zlib, producing and consuming the gzip format, so that
+// compressed values can be sent to clients with Content-Encoding: gzip as is.
+
+// Upper bound on the compressed size of len bytes
+size_t gzip_bound(size_t len);
+// NOTE: Compresses into dst, which holds *dstlen bytes. On success, *dstlen is
+// set to the compressed size.
+int gzip_compress(const void *src, size_t len, void *dst, size_t *dstlen, int level);
+// Decompresses into dst, which must hold exactly the uncompressed size
+int gzip_decompress(const void *src, size_t len, void *dst, size_t dstlen);
+// Uncompressed size, as recorded in the trailer of the stream
+uint32_t gzip_size(const void *src, size_t len);
+
+#endif
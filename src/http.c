@@ -1,4 +1,5 @@
 #include "http.h"
+#include <strings.h>
 
 const kv_t g_http_methods[HTTP_METHOD_MAX] =
 {
@@ -32,5 +33,61 @@ const kv_t g_http_hkeys[HTTP_HKEY_MAX] =
 {
     make_kv("Content-Length", 14),
     make_kv("Connection", 10),
-    make_kv("Keep-Alive", 10)
+    make_kv("Keep-Alive", 10),
+    make_kv("Accept-Encoding", 15),
+    make_kv("Content-Encoding", 16),
+    // Seconds until a paste expires
+    make_kv("X-TTL", 5),
+    make_kv("Vary", 4)
 };
+
+static inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// Checks whether the parameters following a coding, e.g. ";q=0.5", make its weight zero
+static bool zero_weight(const char *params, int len)
+{
+    for (int i = 0; i + 1 < len; i++) {
+        if ((params[i] == 'q' || params[i] == 'Q') && params[i+1] == '=') {
+            for (i += 2; i < len && params[i] != ';' && !is_space(params[i]); i++) {
+                if (params[i] != '0' && params[i] != '.')
+                    return false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool http_accepts_coding(const char *list, int len, const char *coding)
+{
+    size_t coding_len = strlen(coding);
+    // NOTE: "*" stands for the codings the list doesn't name, so an element
+    // naming the coding decides, wherever it is
+    bool any = false;
+    bool any_accepted = false;
+    int i = 0;
+    while (i < len) {
+        // One comma separated element, i.e. a coding followed by its parameters
+        int end = i;
+        while (end < len && list[end] != ',')
+            end++;
+        while (i < end && is_space(list[i]))
+            i++;
+        int name_end = i;
+        while (name_end < end && list[name_end] != ';' && !is_space(list[name_end]))
+            name_end++;
+
+        size_t name_len = (size_t)(name_end - i);
+        if (name_len == coding_len && strncasecmp(list + i, coding, coding_len) == 0)
+            return !zero_weight(list + name_end, end - name_end);
+        if (name_len == 1 && list[i] == '*') {
+            any = true;
+            any_accepted = !zero_weight(list + name_end, end - name_end);
+        }
+        i = end + 1;
+    }
+    return any && any_accepted;
+}
@@ -70,10 +70,18 @@ enum http_hkey
     HTTP_HKEY_CONTENT_LENGTH,
     HTTP_HKEY_CONNECTION,
     HTTP_HKEY_KEEP_ALIVE,
+    HTTP_HKEY_ACCEPT_ENCODING,
+    HTTP_HKEY_CONTENT_ENCODING,
+    HTTP_HKEY_TTL,
+    HTTP_HKEY_VARY,
     HTTP_HKEY_UNKNOWN
 };
 #define HTTP_HKEY_MAX HTTP_HKEY_UNKNOWN
 
 extern const kv_t g_http_hkeys[HTTP_HKEY_MAX];
 
+// NOTE: Checks whether a list of codings, as sent in Accept-Encoding, allows
+// the given one. Codings with q=0 are refused.
+bool http_accepts_coding(const char *list, int len, const char *coding);
+
 #endif
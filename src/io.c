@@ -0,0 +1,238 @@
+#include "io.h"
+#include "event.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+struct io_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Submitted jobs, oldest first
+    struct list jobs;
+    bool stopping;
+    uint32_t num_threads;
+    pthread_t threads[];
+};
+
+struct io_queue
+{
+    struct io_pool *pool;
+    struct event_base *base;
+    int efd;
+    struct event event;
+
+    // Finished jobs, waiting to be completed on the thread of the event base
+    pthread_mutex_t lock;
+    struct list done;
+
+    // Jobs submitted, and not completed yet. Only touched by the thread of the
+    // event base.
+    size_t pending;
+};
+
+// Hands the job back to its queue. The eventfd is only written when the queue
+// goes from empty to non-empty, the event base takes everything queued by then.
+static void finish_job(struct io_job *job)
+{
+    struct io_queue *queue = job->queue;
+    pthread_mutex_lock(&queue->lock);
+    bool wake = !LIST_HEAD(&queue->done);
+    list_add_entry_tail(&queue->done, job, node);
+    pthread_mutex_unlock(&queue->lock);
+
+    if (wake) {
+        uint64_t one = 1;
+        if (write(queue->efd, &one, sizeof one) != sizeof one)
+            perror("IO: eventfd write");
+    }
+}
+
+static void *io_main(void *arg)
+{
+    struct io_pool *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        struct list *node = LIST_HEAD(&pool->jobs);
+        if (!node) {
+            if (pool->stopping)
+                break;
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        struct io_job *jobs[IO_BATCH];
+        uint32_t count = 0;
+        jobs[count++] = list_entry(node, struct io_job, node);
+        list_del(node);
+        while (jobs[0]->run_batch && count < IO_BATCH && (node = LIST_HEAD(&pool->jobs))) {
+            struct io_job *job = list_entry(node, struct io_job, node);
+            if (job->run_batch != jobs[0]->run_batch)
+                break;
+            jobs[count++] = job;
+            list_del(node);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (jobs[0]->run_batch)
+            jobs[0]->run_batch(jobs, count);
+        else
+            jobs[0]->run(jobs[0]);
+        for (uint32_t i = 0; i < count; i++)
+            finish_job(jobs[i]);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void complete_jobs(struct io_queue *queue)
+{
+    struct list done;
+    LIST_INIT_HEAD(done);
+    pthread_mutex_lock(&queue->lock);
+    if (LIST_HEAD(&queue->done)) {
+        done.next = queue->done.next;
+        done.prev = queue->done.prev;
+        done.next->prev = &done;
+        done.prev->next = &done;
+        LIST_INIT_HEAD(queue->done);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    // NOTE: The job may be freed by its callback
+    struct list *iter, *next;
+    list_for_each_safe(iter, next, &done) {
+        struct io_job *job = list_entry(iter, struct io_job, node);
+        list_del(iter);
+        queue->pending--;
+        job->done(job);
+    }
+}
+
+static void on_wake(int fd, uint32_t events, void *data)
+{
+    struct io_queue *queue = data;
+    if (events & EPOLLIN) {
+        uint64_t count;
+        count_syscalls(queue->base, 1);
+        if (read(fd, &count, sizeof count) < 0)
+            return;
+        complete_jobs(queue);
+    } else {
+        fprintf(stderr, "IO: on_wake unknown event\n");
+    }
+}
+
+struct io_pool *create_io_pool(uint32_t num_threads)
+{
+    struct io_pool *pool = calloc(1, sizeof *pool + num_threads * sizeof(pthread_t));
+    if (!pool)
+        return NULL;
+    LIST_INIT_HEAD(pool->jobs);
+    if (pthread_mutex_init(&pool->lock, NULL)) {
+        free(pool);
+        return NULL;
+    }
+    if (pthread_cond_init(&pool->cond, NULL)) {
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+        return NULL;
+    }
+
+    for (; pool->num_threads < num_threads; pool->num_threads++) {
+        if (pthread_create(&pool->threads[pool->num_threads], NULL, io_main, pool)) {
+            perror("IO: pthread_create");
+            destroy_io_pool(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void destroy_io_pool(struct io_pool *pool)
+{
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+struct io_queue *create_io_queue(struct io_pool *pool, struct event_base *base)
+{
+    struct io_queue *queue = calloc(1, sizeof *queue);
+    if (!queue)
+        return NULL;
+    queue->pool = pool;
+    queue->base = base;
+    LIST_INIT_HEAD(queue->done);
+    if (pthread_mutex_init(&queue->lock, NULL)) {
+        free(queue);
+        return NULL;
+    }
+
+    queue->efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (queue->efd < 0) {
+        perror("IO: eventfd");
+        pthread_mutex_destroy(&queue->lock);
+        free(queue);
+        return NULL;
+    }
+    queue->event = make_event(queue->efd, EPOLLIN|EPOLLET, on_wake, queue);
+    if (add_event(base, &queue->event) != OK) {
+        fprintf(stderr, "IO: add_event error\n");
+        close(queue->efd);
+        pthread_mutex_destroy(&queue->lock);
+        free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+void destroy_io_queue(struct io_queue *queue)
+{
+    if (!queue) return;
+    while (queue->pending) {
+        struct pollfd pfd = {queue->efd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0)
+            continue;
+        uint64_t count;
+        if (read(queue->efd, &count, sizeof count) < 0)
+            continue;
+        complete_jobs(queue);
+    }
+
+    del_event(queue->base, &queue->event);
+    close(queue->efd);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+}
+
+void submit_io(struct io_queue *queue, struct io_job *job)
+{
+    struct io_pool *pool = queue->pool;
+    job->queue = queue;
+    queue->pending++;
+    pthread_mutex_lock(&pool->lock);
+    list_add_entry_tail(&pool->jobs, job, node);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void run_io(struct io_job *job)
+{
+    if (job->run_batch)
+        job->run_batch(&job, 1);
+    else
+        job->run(job);
+}
@@ -0,0 +1,46 @@
+#ifndef IO_H
+#define IO_H
+
+#include "common.h"
+#include "list.h"
+
+// Pool of threads running blocking work, i.e. database I/O, off the event
+// loops. A finished job is handed back to the event base it was submitted
+// from through its queue, which wakes the base up with an eventfd, and is
+// completed there.
+
+// Most jobs run together by run_batch
+#define IO_BATCH 32
+
+struct event_base;
+struct io_pool;
+struct io_queue;
+
+struct io_job
+{
+    struct list node;
+    // Runs on one of the pool threads
+    void (*run)(struct io_job *job);
+    // NOTE: If set, runs instead of run, along with the jobs queued right
+    // behind this one that share it, up to a limit. Their I/O can then be
+    // submitted to the disk together.
+    void (*run_batch)(struct io_job **jobs, uint32_t count);
+    // Runs on the thread of the event base afterwards
+    void (*done)(struct io_job *job);
+    // Set by submit_io
+    struct io_queue *queue;
+};
+
+struct io_pool *create_io_pool(uint32_t num_threads);
+// NOTE: The queues of the pool must be destroyed first
+void destroy_io_pool(struct io_pool *pool);
+// Completion queue of an event base, submitting jobs to the pool
+struct io_queue *create_io_queue(struct io_pool *pool, struct event_base *base);
+// NOTE: Waits for the jobs submitted through the queue, and completes them, first
+void destroy_io_queue(struct io_queue *queue);
+// NOTE: Must be called on the thread of the event base
+void submit_io(struct io_queue *queue, struct io_job *job);
+// Runs the job on the calling thread instead, without completing it
+void run_io(struct io_job *job);
+
+#endif
@@ -3,8 +3,8 @@
 #define RBBLK (0)
 #define RBRED (1)
 
-#define RBNIL (&sentinel)
-static struct rbnode sentinel = { RBBLK, RBNIL, RBNIL, NULL };
+// NOTE: Each tree has its own sentinel, as deletion writes to its parent link.
+#define RBNIL (&t->nil)
 
 static void rotate_left(struct rbtree *t, struct rbnode *x);
 static void rotate_right(struct rbtree *t, struct rbnode *x);
@@ -14,6 +14,8 @@ static void delete_fixup(struct rbtree *t, struct rbnode *x);
 void rbtree_init(struct rbtree *t, size_t nodesz, rbcmp cmp)
 {
     zero_structp(t);
+    t->nil.color = RBBLK;
+    t->nil.left = t->nil.right = RBNIL;
     t->root = RBNIL;
     t->nodesz = nodesz;
     t->cmp = cmp;
@@ -44,39 +46,54 @@ void rbtree_insert(struct rbtree *t, struct rbnode *x)
     insert_fixup(t, x);
 }
 
-void rbtree_delete(struct rbtree *t, struct rbnode *z)
+// Replaces the subtree rooted at u with the one rooted at v
+static void transplant(struct rbtree *t, struct rbnode *u, struct rbnode *v)
 {
-    struct rbnode *y;
-    if (z->left == RBNIL || z->right == RBNIL) {
-        y = z;
+    if (!u->parent) {
+        t->root = v;
+    } else if (u == u->parent->left) {
+        u->parent->left = v;
     } else {
-        y = z->right;
-        while (y->left != RBNIL)
-            y = y->left;
+        u->parent->right = v;
     }
+    v->parent = u->parent;
+}
+
+void rbtree_delete(struct rbtree *t, struct rbnode *z)
+{
+    // NOTE: Nodes are embedded in their owners, so the successor is relinked
+    // into z's place, instead of copying its contents over z.
     struct rbnode *x;
-    if (y->left != RBNIL) {
-        x = y->left;
+    char color = z->color;
+    if (z->left == RBNIL) {
+        x = z->right;
+        transplant(t, z, z->right);
+    } else if (z->right == RBNIL) {
+        x = z->left;
+        transplant(t, z, z->left);
     } else {
+        struct rbnode *y = z->right;
+        while (y->left != RBNIL)
+            y = y->left;
+        color = y->color;
         x = y->right;
-    }
-    x->parent = y->parent;
-    if (y->parent) {
-        if (y == y->parent->left) {
-            y->parent->left = x;
+        if (y->parent == z) {
+            x->parent = y;
         } else {
-            y->parent->right = x;
+            transplant(t, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
         }
-    } else {
-        t->root = x;
+        transplant(t, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->color = z->color;
     }
-    if (y != z)
-        memcpy(z+1, y+1, t->nodesz-sizeof(struct rbnode)); // NOLINT
-    if (y->color == RBBLK)
+    if (color == RBBLK)
         delete_fixup(t, x);
 }
 
-struct rbnode *rbtree_leftmost(struct rbnode *x)
+struct rbnode *rbtree_leftmost(struct rbtree *t, struct rbnode *x)
 {
     if (x == RBNIL)
         return NULL;
@@ -88,7 +105,7 @@ struct rbnode *rbtree_leftmost(struct rbnode *x)
     return x;
 }
 
-struct rbnode *rbtree_rightmost(struct rbnode *x)
+struct rbnode *rbtree_rightmost(struct rbtree *t, struct rbnode *x)
 {
     if (x == RBNIL)
         return NULL;
@@ -15,6 +15,7 @@ typedef int (*rbcmp)(const struct rbnode *, const struct rbnode *);
 
 struct rbtree
 {
+    struct rbnode nil;
     struct rbnode *root;
     size_t nodesz;
     rbcmp cmp;
@@ -23,8 +24,8 @@ struct rbtree
 void rbtree_init(struct rbtree *t, size_t nodesz, rbcmp cmp);
 void rbtree_insert(struct rbtree *t, struct rbnode *x);
 void rbtree_delete(struct rbtree *t, struct rbnode *z);
-struct rbnode *rbtree_leftmost(struct rbnode *x);
-struct rbnode *rbtree_rightmost(struct rbnode *x);
+struct rbnode *rbtree_leftmost(struct rbtree *t, struct rbnode *x);
+struct rbnode *rbtree_rightmost(struct rbtree *t, struct rbnode *x);
 struct rbnode *rbtree_upper_bound(struct rbtree *t, struct rbnode *x);
 
 #endif
@@ -1,8 +1,11 @@
 #include "buffer.h"
 #include "connection.h"
+#include "io.h"
 #include "request.h"
+#include "worker.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 
 static inline int span(const char *s, char c, int len, int off)
 {
@@ -142,7 +145,8 @@ static const struct http_header *find_header(const struct request *req, const ch
     for (int i = 0; i < req->num_headers; i++) {
         const struct http_header *header = &req->headers[i];
         if (header->key.len == len) {
-            if (strncmp(data + header->key.off, key, (size_t)len) == 0)
+            // Header names are case-insensitive
+            if (strncasecmp(data + header->key.off, key, (size_t)len) == 0)
                 return header;
         }
     }
@@ -216,37 +220,150 @@ int parse_request(struct request *req)
     return REQ_OK;
 }
 
-void send_response(struct request *req, enum http_status status, const char *body, size_t len)
+size_t format_headers(struct request *req, enum http_status status, size_t len, char *out)
 {
     struct connection *c = get_connection(req);
-    buffer_t *buf = c->buffer;
-    clear_buffer(buf);
-
-    char tmp[128];
+    size_t off = 0;
     int n;
 
-    n = snprintf(tmp, 128, "%s %s\r\n", g_http_versions[req->version].s, g_http_statuses[status].s); // NOLINT [C11 Annex K]
-    push_buffer(buf, tmp, (size_t)n);
+    n = snprintf(out, RESPONSE_HEADERS_MAX, "%s %s\r\n", g_http_versions[req->version].s, g_http_statuses[status].s); // NOLINT [C11 Annex K]
+    off += (size_t)n;
 
     if (c->flags & CONNECTION_FLAG_KEEPALIVE) {
-        n = snprintf(tmp, 128, "%s: keep-alive\r\n", g_http_hkeys[HTTP_HKEY_CONNECTION].s); // NOLINT [C11 Annex K]
-        push_buffer(buf, tmp, (size_t)n);
-        n = snprintf(tmp, 128, "%s: timeout=5\r\n", g_http_hkeys[HTTP_HKEY_KEEP_ALIVE].s); // NOLINT [C11 Annex K]
-        push_buffer(buf, tmp, (size_t)n);
+        n = snprintf(out + off, RESPONSE_HEADERS_MAX - off, "%s: keep-alive\r\n", g_http_hkeys[HTTP_HKEY_CONNECTION].s); // NOLINT [C11 Annex K]
+        off += (size_t)n;
+        n = snprintf(out + off, RESPONSE_HEADERS_MAX - off, "%s: timeout=5\r\n", g_http_hkeys[HTTP_HKEY_KEEP_ALIVE].s); // NOLINT [C11 Annex K]
+        off += (size_t)n;
+    }
+
+    if (req->encoding) {
+        n = snprintf(out + off, RESPONSE_HEADERS_MAX - off, "%s: %s\r\n", g_http_hkeys[HTTP_HKEY_CONTENT_ENCODING].s, req->encoding); // NOLINT [C11 Annex K]
+        off += (size_t)n;
+    }
+    if (req->vary) {
+        n = snprintf(out + off, RESPONSE_HEADERS_MAX - off, "%s: %s\r\n", g_http_hkeys[HTTP_HKEY_VARY].s, req->vary); // NOLINT [C11 Annex K]
+        off += (size_t)n;
     }
 
-    n = snprintf(tmp, 128, "%s: %lu\r\n\r\n", g_http_hkeys[HTTP_HKEY_CONTENT_LENGTH].s, len); // NOLINT [C11 Annex K]
-    push_buffer(buf, tmp, (size_t)n);
+    n = snprintf(out + off, RESPONSE_HEADERS_MAX - off, "%s: %lu\r\n\r\n", g_http_hkeys[HTTP_HKEY_CONTENT_LENGTH].s, len); // NOLINT [C11 Annex K]
+    off += (size_t)n;
+    return off;
+}
+
+uint32_t response_variant(struct request *req)
+{
+    struct connection *c = get_connection(req);
+    uint32_t keepalive = (c->flags & CONNECTION_FLAG_KEEPALIVE) ? 1 : 0;
+    return ((uint32_t)req->version << 1) | keepalive;
+}
+
+static void write_headers(struct request *req, enum http_status status, size_t len)
+{
+    struct connection *c = get_connection(req);
+    buffer_t *buf = c->buffer;
+    clear_buffer(buf);
+
+    char tmp[RESPONSE_HEADERS_MAX];
+    size_t n = format_headers(req, status, len, tmp);
+    push_buffer(buf, tmp, n);
+}
+
+void send_response(struct request *req, enum http_status status, const char *body, size_t len)
+{
+    struct connection *c = get_connection(req);
+    write_headers(req, status, len);
 
-    
     if (len) {
         assert(body);
-        push_buffer(buf, body, (size_t)len);
+        push_buffer(c->buffer, body, (size_t)len);
     }
 
+    c->body = NULL;
+    c->body_fd = -1;
+    c->body_len = 0;
+    begin_send(c);
+}
+
+void send_response_ref(struct request *req, enum http_status status, const char *body, size_t len,
+                       void (*release)(void *), void *release_data)
+{
+    struct connection *c = get_connection(req);
+    write_headers(req, status, len);
+
+    // The body is sent straight from the caller's memory, after the headers
+    c->body = body;
+    c->body_fd = -1;
+    c->body_len = len;
+    c->body_release = release;
+    c->body_release_data = release_data;
+    begin_send(c);
+}
+
+void send_response_raw(struct request *req, const char *data, size_t len,
+                       void (*release)(void *), void *release_data)
+{
+    struct connection *c = get_connection(req);
+    clear_buffer(c->buffer);
+
+    // Status line, headers and body, all in one piece
+    c->body = data;
+    c->body_fd = -1;
+    c->body_len = len;
+    c->body_release = release;
+    c->body_release_data = release_data;
+    begin_send(c);
+}
+
+void send_response_file(struct request *req, enum http_status status, int fd, off_t offset, size_t len,
+                        void (*release)(void *), void *release_data)
+{
+    struct connection *c = get_connection(req);
+    write_headers(req, status, len);
+
+    // The body is sent from the file with sendfile, after the headers
+    c->body = NULL;
+    c->body_fd = fd;
+    c->body_off = offset;
+    c->body_len = len;
+    c->body_release = release;
+    c->body_release_data = release_data;
     begin_send(c);
 }
 
+void defer_response(struct request *req, struct io_job *job)
+{
+    struct connection *c = get_connection(req);
+    struct io_queue *queue = c->worker->io;
+    if (!queue) {
+        run_io(job);
+        job->done(job);
+        return;
+    }
+    begin_wait(c);
+    submit_io(queue, job);
+}
+
+const char *get_header(struct request *req, enum http_hkey key, int *len)
+{
+    struct connection *c = get_connection(req);
+    buffer_t *buf = c->buffer;
+    const struct http_header *header = find_header(req, g_http_hkeys[key].s, g_http_hkeys[key].len, buf);
+    if (!header)
+        return NULL;
+    *len = header->val.len;
+    return buf->data + header->val.off;
+}
+
+void set_content_encoding(struct request *req, const char *encoding)
+{
+    req->encoding = encoding;
+}
+
+void set_vary(struct request *req, const char *vary)
+{
+    req->vary = vary;
+}
+
 const char *get_uri(struct request *req, int *len)
 {
     struct connection *c = get_connection(req);
@@ -2,11 +2,17 @@
 #define REQUEST_H
 
 #include "http.h"
+#include <sys/types.h>
 
 #define MAX_HEADERS 32
 #define MAX_BODY (128*1024)
+// Enough for the status line and the headers we send
+#define RESPONSE_HEADERS_MAX 256
+// Number of bits needed for response_variant
+#define RESPONSE_VARIANT_BITS 3
 
 struct connection;
+struct io_job;
 
 enum request_state
 {
@@ -28,6 +34,11 @@ struct request
     int num_headers;
     struct http_header headers[MAX_HEADERS];
     string_t body;
+
+    // Content-Encoding of the response body, if any
+    const char *encoding;
+    // Request headers the response depends on, if any
+    const char *vary;
 };
 
 #define REQ_ERR (-1)
@@ -36,10 +47,41 @@ struct request
 
 int parse_request(struct request *req);
 void send_response(struct request *req, enum http_status status, const char *body, size_t len);
+// NOTE: Doesn't copy the body, which must stay valid until the response has been
+// sent. If release is set, release(release_data) is called once it isn't needed anymore.
+void send_response_ref(struct request *req, enum http_status status, const char *body, size_t len,
+                       void (*release)(void *), void *release_data);
+// NOTE: Sends an already serialized response, status line and headers included.
+// Doesn't copy it, release(data) is called once it isn't needed anymore.
+void send_response_raw(struct request *req, const char *data, size_t len,
+                       void (*release)(void *), void *release_data);
+// NOTE: Sends len bytes of the file at offset as the body. The fd must stay open until the response has been sent.
+// If release is set, release(release_data) is called once it isn't needed anymore.
+void send_response_file(struct request *req, enum http_status status, int fd, off_t offset, size_t len,
+                        void (*release)(void *), void *release_data);
+
+// NOTE: Runs the job on the I/O threads, if there are any, and its done callback
+// back on the worker, which sends the response. The connection waits meanwhile.
+// Without I/O threads, both run right away.
+void defer_response(struct request *req, struct io_job *job);
+
+// NOTE: Writes the status line and headers of a response into out, which must
+// hold at least RESPONSE_HEADERS_MAX bytes. Returns their length.
+size_t format_headers(struct request *req, enum http_status status, size_t len, char *out);
+// Identifies the HTTP version and keep-alive combination the response
+// headers depend on. Responses can be reused between requests that match,
+// provided that they're sent with the same encoding.
+uint32_t response_variant(struct request *req);
 
 const char *get_uri(struct request *req, int *len);
 const char *get_body(struct request *req, int *len);
-
-// TODO: API to get the headers, too
+// Returns the value of the header, or NULL if the request doesn't have it
+const char *get_header(struct request *req, enum http_hkey key, int *len);
+// NOTE: Must be called before sending the response, the encoding is only
+// referenced, not copied.
+void set_content_encoding(struct request *req, const char *encoding);
+// NOTE: Names the request headers the response was chosen by, for caches. Same
+// as above, must be called before sending, and is only referenced.
+void set_vary(struct request *req, const char *vary);
 
 #endif
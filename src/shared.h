@@ -8,6 +8,7 @@
 #define UNIX_PATH_MAX 108
 
 #define IPC_CMD_STATUS 0x00
+#define IPC_CMD_RESIZE 0x01
 
 #pragma pack(push, 1)
 struct ipc_request
@@ -22,6 +23,18 @@ struct ipc_status
 {
     uint64_t uptime;
     uint32_t num_workers;
+    uint64_t db_count;
+    uint64_t db_capacity;
+    uint64_t db_dedup_hits;
+    uint64_t db_expired;
+    uint64_t db_reclaimed;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_evictions;
+    uint64_t cache_bytes;
+    // Page faults of the server process so far
+    uint64_t minor_faults;
+    uint64_t major_faults;
 };
 
 struct worker_status
@@ -29,6 +42,9 @@ struct worker_status
     thread_id id;
     bool running;
     size_t num_conns;
+    uint64_t num_requests;
+    // Made by the worker's thread, see event_base_syscalls
+    uint64_t syscalls;
 };
 
 #pragma pack(pop)
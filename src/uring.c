@@ -0,0 +1,291 @@
+#include "uring.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE)
+
+struct uring
+{
+    int fd;
+    void *map;
+    size_t map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    // Submission queue, shared with the kernel
+    _Atomic uint32_t *sq_head;
+    _Atomic uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    // Entries up to here are queued, and handed to the kernel on submit
+    uint32_t sqe_tail;
+
+    // Completion queue, shared with the kernel
+    _Atomic uint32_t *cq_head;
+    _Atomic uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    uint32_t inflight;
+    uint32_t features;
+};
+
+struct uring_bufs
+{
+    // Shared with the kernel, the tail overlays the last field of the first entry
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint32_t mask;
+    uint16_t tail;
+
+    char *data;
+    uint32_t size;
+    uint32_t count;
+};
+
+static inline int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int uring_enter_arg(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags,
+                                  const struct io_uring_getevents_arg *arg)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags | IORING_ENTER_EXT_ARG,
+                        arg, sizeof *arg);
+}
+
+struct uring *create_uring(uint32_t entries)
+{
+    struct uring *ring = calloc(1, sizeof *ring);
+    if (!ring)
+        return NULL;
+
+    struct io_uring_params params = {0};
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        goto error_setup;
+    if ((params.features & URING_FEATURES) != URING_FEATURES) {
+        errno = ENOSYS;
+        goto error_map;
+    }
+    ring->features = params.features;
+
+    // NOTE: With a single mapping, both queues live in the one for the
+    // submission queue, which has to be large enough for either
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->map_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                     ring->fd, IORING_OFF_SQ_RING);
+    if (ring->map == MAP_FAILED)
+        goto error_map;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error_sqes;
+
+    char *map = ring->map;
+    ring->sq_head = (_Atomic uint32_t *)(void *)(map + params.sq_off.head);
+    ring->sq_tail = (_Atomic uint32_t *)(void *)(map + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(void *)(map + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    ring->cq_head = (_Atomic uint32_t *)(void *)(map + params.cq_off.head);
+    ring->cq_tail = (_Atomic uint32_t *)(void *)(map + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(void *)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(void *)(map + params.cq_off.cqes);
+
+    // Slot i of the queue always holds entry i, only the tail moves
+    uint32_t *array = (uint32_t *)(void *)(map + params.sq_off.array);
+    for (uint32_t i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+    return ring;
+
+error_sqes:
+    munmap(ring->map, ring->map_size);
+error_map:;
+    int err = errno;
+    close(ring->fd);
+    errno = err;
+error_setup:
+    free(ring);
+    return NULL;
+}
+
+void destroy_uring(struct uring *ring)
+{
+    if (!ring) return;
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->map, ring->map_size);
+    close(ring->fd);
+    free(ring);
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring)
+{
+    uint32_t head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+        return NULL;
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    zero_structp(sqe);
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, bool wait)
+{
+    int ret = OK;
+    uint32_t head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    atomic_store_explicit(ring->sq_tail, ring->sqe_tail, memory_order_release);
+    while (head != ring->sqe_tail) {
+        if (uring_enter(ring->fd, ring->sqe_tail - head, 0, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            ret = ERR;
+        }
+        uint32_t now = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        ring->inflight += now - head;
+        head = now;
+        if (ret != OK) {
+            ring->sqe_tail = head;
+            atomic_store_explicit(ring->sq_tail, head, memory_order_release);
+        }
+    }
+
+    while (ret == OK && wait) {
+        uint32_t ready = atomic_load_explicit(ring->cq_tail, memory_order_acquire) -
+                         atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        if (ready >= ring->inflight)
+            break;
+        if (uring_enter(ring->fd, 0, ring->inflight - ready, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            ret = ERR;
+    }
+    return ret;
+}
+
+int uring_flush(struct uring *ring, int timeout)
+{
+    uint32_t head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    atomic_store_explicit(ring->sq_tail, ring->sqe_tail, memory_order_release);
+
+    struct __kernel_timespec ts = {0};
+    struct io_uring_getevents_arg arg = {0};
+    uint32_t flags = 0;
+    if (timeout) {
+        flags = IORING_ENTER_GETEVENTS;
+        if (timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+
+    int ret = OK;
+    if (uring_enter_arg(ring->fd, ring->sqe_tail - head, timeout ? 1 : 0, flags, &arg) < 0 &&
+        errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+        ret = ERR;
+    }
+    ring->inflight += atomic_load_explicit(ring->sq_head, memory_order_acquire) - head;
+    return ret;
+}
+
+bool uring_complete_flags(struct uring *ring, uint64_t *user_data, int32_t *res, uint32_t *flags)
+{
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire))
+        return false;
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    *flags = cqe->flags;
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+    if (!(*flags & IORING_CQE_F_MORE))
+        ring->inflight--;
+    return true;
+}
+
+bool uring_complete(struct uring *ring, uint64_t *user_data, int32_t *res)
+{
+    uint32_t flags;
+    return uring_complete_flags(ring, user_data, res, &flags);
+}
+
+uint32_t uring_inflight(const struct uring *ring)
+{
+    return ring->inflight;
+}
+
+uint32_t uring_queued(const struct uring *ring)
+{
+    return ring->sqe_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+}
+
+uint32_t uring_features(const struct uring *ring)
+{
+    return ring->features;
+}
+
+struct uring_bufs *create_uring_bufs(struct uring *ring, uint16_t group, uint32_t count, uint32_t size)
+{
+    struct uring_bufs *bufs = calloc(1, sizeof *bufs);
+    if (!bufs)
+        return NULL;
+    bufs->mask = count - 1;
+    bufs->size = size;
+    bufs->count = count;
+
+    bufs->br_size = count * sizeof(struct io_uring_buf);
+    bufs->br = mmap(NULL, bufs->br_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (bufs->br == MAP_FAILED)
+        goto error_br;
+    bufs->data = mmap(NULL, (size_t)count * size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (bufs->data == MAP_FAILED)
+        goto error_data;
+
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (uint64_t)(uintptr_t)bufs->br;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto error_register;
+
+    for (uint32_t i = 0; i < count; i++)
+        uring_put_buf(bufs, (uint16_t)i);
+    return bufs;
+
+error_register:
+    munmap(bufs->data, (size_t)count * size);
+error_data:
+    munmap(bufs->br, bufs->br_size);
+error_br:
+    free(bufs);
+    return NULL;
+}
+
+void destroy_uring_bufs(struct uring_bufs *bufs)
+{
+    if (!bufs) return;
+    munmap(bufs->data, (size_t)bufs->count * bufs->size);
+    munmap(bufs->br, bufs->br_size);
+    free(bufs);
+}
+
+char *uring_buf(const struct uring_bufs *bufs, uint16_t id)
+{
+    return bufs->data + (size_t)id * bufs->size;
+}
+
+void uring_put_buf(struct uring_bufs *bufs, uint16_t id)
+{
+    struct io_uring_buf *buf = &bufs->br->bufs[bufs->tail & bufs->mask];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf(bufs, id);
+    buf->len = bufs->size;
+    buf->bid = id;
+    bufs->tail++;
+    atomic_store_explicit((_Atomic uint16_t *)&bufs->br->tail, bufs->tail, memory_order_release);
+}
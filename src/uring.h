@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+
+#include "common.h"
+#include <linux/io_uring.h>
+
+// Minimal io_uring on the raw system calls. A ring is only ever used by one
+// thread at a time.
+
+struct uring;
+struct uring_bufs;
+
+// NOTE: Returns NULL, with errno set, if the kernel lacks io_uring, or one of
+// the features relied on here: a single mapping, entries that may be reused
+// once submitted, and completions that are never dropped.
+struct uring *create_uring(uint32_t entries);
+void destroy_uring(struct uring *ring);
+// Returns a zeroed submission entry to fill in, or NULL if the queue is full
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+// NOTE: Submits the queued entries, whatever they point to may be reused
+// afterwards. If wait is set, also waits until everything submitted has
+// completed. Entries that can't be submitted are dropped.
+int uring_submit(struct uring *ring, bool wait);
+// NOTE: Submits the queued entries, and unless timeout is 0, waits up to that
+// many milliseconds (-1 for ever) for a completion, all in one system call.
+// Unlike uring_submit, entries the kernel doesn't take yet stay queued. Needs
+// IORING_FEAT_EXT_ARG.
+int uring_flush(struct uring *ring, int timeout);
+// Takes the next completion, returns false if there is none
+bool uring_complete(struct uring *ring, uint64_t *user_data, int32_t *res);
+// Same, with the flags of the completion. A request with more completions to
+// come only counts as done with its last one.
+bool uring_complete_flags(struct uring *ring, uint64_t *user_data, int32_t *res, uint32_t *flags);
+// Entries submitted, and not taken with uring_complete yet
+uint32_t uring_inflight(const struct uring *ring);
+// Entries queued, and not taken by the kernel yet
+uint32_t uring_queued(const struct uring *ring);
+uint32_t uring_features(const struct uring *ring);
+
+// NOTE: Registers count (a power of two) buffers of size bytes each with the
+// ring, as the given group. A receive with IOSQE_BUFFER_SELECT on the group
+// takes one whenever data arrives, and names it in its completion. It belongs
+// to the caller from then on, until put back. Destroyed after the ring.
+struct uring_bufs *create_uring_bufs(struct uring *ring, uint16_t group, uint32_t count, uint32_t size);
+void destroy_uring_bufs(struct uring_bufs *bufs);
+char *uring_buf(const struct uring_bufs *bufs, uint16_t id);
+void uring_put_buf(struct uring_bufs *bufs, uint16_t id);
+
+static inline void uring_prep(struct io_uring_sqe *sqe, uint8_t opcode, int fd, const void *addr,
+                              uint32_t len, uint64_t offset, uint64_t user_data)
+{
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+}
+
+#endif
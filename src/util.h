@@ -4,5 +4,10 @@
 #include "common.h"
 
 uint64_t get_time(void);
+// Fast, non-cryptographic hash
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+// NOTE: CRC32C (Castagnoli). Pass 0 to start, or the previous result to
+// continue over more data. Uses the SSE4.2 instruction when the CPU has it.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
 
 #endif
@@ -2,9 +2,11 @@
 #include "worker.h"
 #include "event.h"
 #include "connection.h"
+#include "io.h"
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -13,6 +15,8 @@
 static void destroy_worker(struct worker *worker)
 {
     fprintf(stderr, "Worker #%ld preparing shutdown...\n", worker->id);
+    // Connections waiting for I/O are only safe to close once it's done
+    destroy_io_queue(worker->io);
     struct list *iter, *next;
     list_for_each_safe(iter, next, &worker->conns) {
         struct connection *c = list_entry(iter, struct connection, node);
@@ -35,7 +39,6 @@ static void *worker_proc(void *arg)
     void *ret = 0;
     struct worker *worker = arg;
     struct event_base *base = worker->base;
-    worker->running = true;
     fprintf(stderr, "Worker #%ld started\n", worker->id);
     while(worker->running) {
         if (event_base_iter(base) != OK) {
@@ -45,7 +48,7 @@ static void *worker_proc(void *arg)
             break;
         }
     }
-    destroy_worker(worker);
+    // NOTE: Destroyed by shutdown_worker, once joined
     pthread_exit(ret);
 }
 
@@ -54,17 +57,33 @@ static void on_accept(int fd, uint32_t events, void *data)
     UNUSED(fd);
     struct worker *worker = data;
     if (events & EPOLLIN) {
-        if (accept_connection(worker) != OK) {
-            fprintf(stderr, "Worker: accept_connection error\n");
-        } else {
-            // NOTE: The decrement on close is done in connection.c
-            worker->num_conns++;
-        }
+        // NOTE: The socket is edge-triggered, so everything that is queued has
+        // to be accepted now.
+        while (accept_connection(worker) == OK)
+            continue;
     } else {
         fprintf(stderr, "Worker: on_accept unknown event\n");
     }
 }
 
+// NOTE: With io_uring, the base accepts the connections
+static void on_accepted(int32_t res, const char *data, void *arg)
+{
+    UNUSED(data);
+    struct worker *worker = arg;
+    if (res >= 0) {
+        open_connection(worker, res);
+        return;
+    }
+    if (res == -ECANCELED)
+        return;
+
+    // Keeps accepting, once there are fds to spare again
+    fprintf(stderr, "Worker: accept error: %s\n", strerror(-res));
+    if (!(worker->event.flags & EVENT_FLAG_ACTIVE) && submit_accept(worker->base, &worker->event) != OK)
+        fprintf(stderr, "Worker: submit_accept error\n");
+}
+
 int start_worker(void)
 {
     struct addrinfo *ai = g_cask->ai;
@@ -74,6 +93,11 @@ int start_worker(void)
         return ERR;
     }
 
+    if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0) {
+        perror("Worker: fcntl");
+        close(sock);
+        return ERR;
+    }
     if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
         perror("Worker: setsockopt");
         close(sock);
@@ -102,7 +126,7 @@ int start_worker(void)
         return ERR;
     }
 
-    struct event_base *base = create_event_base();
+    struct event_base *base = create_event_base(g_cask->events, g_cask->timers, g_cask->busy_poll);
     if (!base) {
         fprintf(stderr, "Worker: create_event_base error\n");
         close(sock);
@@ -110,8 +134,16 @@ int start_worker(void)
         return ERR;
     }
 
-    worker->event = make_event(sock, EPOLLIN|EPOLLET, on_accept, worker);
-    if (add_event(base, &worker->event) != OK) {
+    worker->base = base;
+    int ret;
+    if (event_base_ops(base)) {
+        worker->event = make_op(sock, on_accepted, worker);
+        ret = submit_accept(base, &worker->event);
+    } else {
+        worker->event = make_event(sock, EPOLLIN|EPOLLET, on_accept, worker);
+        ret = add_event(base, &worker->event);
+    }
+    if (ret != OK) {
         fprintf(stderr, "Worker: add_event error\n");
         close(sock);
         destroy_event_base(base);
@@ -119,18 +151,30 @@ int start_worker(void)
         return ERR;
     }
 
+    if (g_cask->io) {
+        worker->io = create_io_queue(g_cask->io, base);
+        if (!worker->io) {
+            fprintf(stderr, "Worker: create_io_queue error\n");
+            close(sock);
+            destroy_event_base(base);
+            free(worker);
+            return ERR;
+        }
+    }
+
     worker->sock = sock;
-    worker->base = base;
     LIST_INIT_HEAD(worker->conns);
 
     pthread_mutex_lock(&g_cask->worker_lock);
     worker->id = g_cask->current_id++;
     list_add_entry_tail(&g_cask->workers, worker, node);
 
-    int ret = OK;
+    ret = OK;
+    worker->running = true;
     if (pthread_create(&worker->thread, NULL, worker_proc, worker)) {
         perror("Worker: pthread_create");
         list_del_entry(worker, node);
+        destroy_io_queue(worker->io);
         close(sock);
         destroy_event_base(base);
         free(worker);
@@ -141,10 +185,13 @@ int start_worker(void)
     return ret;
 }
 
+// NOTE: The worker may be asleep until its next timer, or for good if it has
+// none, so it is woken up to notice
 void shutdown_worker(struct worker *worker)
 {
-    if (worker->running) {
-        worker->running = false;
-        pthread_join(worker->thread, NULL);
-    }
+    worker->running = false;
+    if (wake_event_base(worker->base) != OK)
+        perror("Worker: wake_event_base");
+    pthread_join(worker->thread, NULL);
+    destroy_worker(worker);
 }
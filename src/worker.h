@@ -7,6 +7,7 @@
 #include <pthread.h>
 
 struct event_base;
+struct io_queue;
 
 // NOTE: There should probably be proper ipc with the main thread, for worker termination,
 // and data that can be accessed from the main thread, such as the connection count.
@@ -28,8 +29,13 @@ struct worker
     // NOTE: This doesn't prevent the data race between the main thread and the worker, when
     // reading this variable. However, it's not *really* vital to prevent said data race.
     volatile size_t num_conns;
+    // Requests received, same as above
+    volatile uint64_t num_requests;
 
     struct event_base *base;
+    // Completions of the I/O jobs of the connections, NULL if there are no
+    // I/O threads
+    struct io_queue *io;
 };
 
 int start_worker(void);
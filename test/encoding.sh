@@ -0,0 +1,91 @@
+#!/bin/sh
+# Content negotiation: pastes stored gzip compressed are sent as stored only to
+# clients whose Accept-Encoding takes gzip, and say so with Vary.
+# Usage: test/encoding.sh [path to cask [options]], run from the repository root.
+
+BIN=${1:-bin/cask}
+[ $# -gt 0 ] && shift
+PORT=${PORT:-3979}
+DIR=$(mktemp -d)
+URL=http://127.0.0.1:$PORT
+PID=
+FAILED=0
+
+cleanup() {
+    [ -n "$PID" ] && kill -9 "$PID" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+start() {
+    rm -f "$DIR/test.sock"
+    "$BIN" -p "$PORT" -w 1 -d "$DIR/test.db" -s "$DIR/test.sock" "$@" 2>>"$DIR/log" &
+    PID=$!
+    for _ in $(seq 50); do
+        curl -s -o /dev/null "$URL/" && return
+        sleep 0.1
+    done
+    echo "encoding: cask didn't start"
+    cat "$DIR/log"
+    exit 1
+}
+
+stop() {
+    kill -INT "$PID"
+    wait "$PID" 2>/dev/null
+    PID=
+}
+
+post() {
+    curl -s -X POST --data-binary "$1" "$URL/"
+}
+
+# Value of the response header, empty if it's missing
+header() {
+    grep -i "^$1:" "$DIR/headers" | cut -d: -f2- | tr -d '\r' | sed 's/^ *//'
+}
+
+# Fetches the paste with the given Accept-Encoding, none if it's empty, and
+# checks the Content-Encoding and Vary of the response. A body sent as is has
+# to be the paste itself.
+expect() {
+    if [ -n "$2" ]; then
+        curl -s -D "$DIR/headers" -o "$DIR/body" -H "Accept-Encoding: $2" "$URL/$1"
+    else
+        curl -s -D "$DIR/headers" -o "$DIR/body" "$URL/$1"
+    fi
+    encoding=$(header Content-Encoding)
+    vary=$(header Vary)
+    if [ "$encoding" != "$3" ] || [ "$vary" != "$4" ]; then
+        echo "encoding: Accept-Encoding '$2': expected Content-Encoding '$3' and Vary '$4', got '$encoding' and '$vary'"
+        FAILED=1
+    elif [ -z "$encoding" ] && [ "$(cat "$DIR/body")" != "$5" ]; then
+        echo "encoding: Accept-Encoding '$2': got a different body"
+        FAILED=1
+    fi
+}
+
+start -z 6 "$@"
+# Long and repetitive enough to be stored compressed, unlike the short one
+LONG=$(printf 'compressible paste %.0s' $(seq 20))
+SHORT="short paste"
+L=$(post "$LONG")
+S=$(post "$SHORT")
+
+# Twice, the second time the response comes from the cache
+for _ in 1 2; do
+    expect "$L" "gzip" "gzip" "Accept-Encoding"
+    expect "$L" "gzip;q=0 " "" "Accept-Encoding" "$LONG"
+    expect "$L" "gzip;q=0 , identity" "" "Accept-Encoding" "$LONG"
+    expect "$L" "*, gzip;q=0" "" "Accept-Encoding" "$LONG"
+    expect "$L" "identity" "" "Accept-Encoding" "$LONG"
+    expect "$L" "" "" "Accept-Encoding" "$LONG"
+    expect "$S" "gzip" "" "" "$SHORT"
+    expect "$S" "" "" "" "$SHORT"
+done
+stop
+
+if [ "$FAILED" = 0 ]; then
+    echo "encoding: ok"
+fi
+exit "$FAILED"
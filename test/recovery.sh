@@ -0,0 +1,122 @@
+#!/bin/sh
+# Crash recovery: records written after a hole, i.e. a range that was reserved
+# but never written, or a torn record, have to survive rebuilding the index.
+# Usage: test/recovery.sh [path to cask [options]], run from the repository root.
+
+BIN=${1:-bin/cask}
+[ $# -gt 0 ] && shift
+PORT=${PORT:-3979}
+DIR=$(mktemp -d)
+URL=http://127.0.0.1:$PORT
+PID=
+FAILED=0
+
+cleanup() {
+    [ -n "$PID" ] && kill -9 "$PID" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+start() {
+    rm -f "$DIR/test.sock"
+    "$BIN" -p "$PORT" -w 1 -d "$DIR/test.db" -s "$DIR/test.sock" "$@" 2>>"$DIR/log" &
+    PID=$!
+    for _ in $(seq 50); do
+        curl -s -o /dev/null "$URL/" && return
+        sleep 0.1
+    done
+    echo "recovery: cask didn't start"
+    cat "$DIR/log"
+    exit 1
+}
+
+crash() {
+    kill -9 "$PID"
+    wait "$PID" 2>/dev/null
+    PID=
+}
+
+stop() {
+    kill -INT "$PID"
+    wait "$PID" 2>/dev/null
+    PID=
+}
+
+post() {
+    curl -s -X POST --data-binary "$1" "$URL/"
+}
+
+expect() {
+    got=$(curl -s "$URL/$1")
+    if [ "$got" != "$2" ]; then
+        echo "recovery: $3: expected '$2' for /$1, got '$got'"
+        FAILED=1
+    fi
+}
+
+expect_missing() {
+    code=$(curl -s -o /dev/null -w '%{http_code}' "$URL/$1")
+    if [ "$code" != 404 ]; then
+        echo "recovery: $2: expected /$1 to be gone, got $code"
+        FAILED=1
+    fi
+}
+
+# Offset of the record holding the value in the file. Its header is 20 bytes,
+# and a checksum of 4 bytes follows the value.
+record_offset() {
+    echo $(($(grep -obUa "$1" "$2" | head -n 1 | cut -d: -f1) - 20))
+}
+
+# The segment file holding the value. The index keeps copies of small values,
+# so it is left out.
+file_of() {
+    grep -laU "$1" "$DIR"/test.db.[0-9]* | head -n 1
+}
+
+# Zeroes the record holding the value, as if its insert never got to write it
+unwrite() {
+    file=$(file_of "$1")
+    dd if=/dev/zero of="$file" bs=1 seek="$(record_offset "$1" "$file")" \
+       count=$((20 + ${#1} + 4)) conv=notrunc 2>/dev/null
+}
+
+# Damages the value of the record, as if the crash tore its write
+tear() {
+    file=$(file_of "$1")
+    printf 'X' | dd of="$file" bs=1 seek=$(($(record_offset "$1" "$file") + 20)) \
+                    conv=notrunc 2>/dev/null
+}
+
+start "$@"
+A=$(post "recovery value a")
+B=$(post "recovery value b")
+C=$(post "recovery value c")
+D=$(post "recovery value d")
+crash
+
+unwrite "recovery value b"
+tear "recovery value c"
+start "$@"
+expect "$A" "recovery value a" "record before the hole"
+expect_missing "$B" "unwritten record"
+expect_missing "$C" "torn record"
+expect "$D" "recovery value d" "record after the hole"
+
+E=$(post "recovery value e")
+if [ "$E" = "$A" ] || [ "$E" = "$D" ]; then
+    echo "recovery: id $E was handed out again"
+    FAILED=1
+fi
+stop
+
+# The records after the hole must still be there on the next start
+start "$@"
+expect "$D" "recovery value d" "record after the hole, after a restart"
+expect "$E" "recovery value e" "record inserted after recovery"
+stop
+
+if [ "$FAILED" = 0 ]; then
+    echo "recovery: ok"
+fi
+exit "$FAILED"
@@ -0,0 +1,94 @@
+#!/bin/bash
+# Keep-alive timeouts: connections are closed 5 s after they were last used,
+# with either timer backend. Needs bash, for /dev/tcp.
+# Usage: test/timeout.sh [path to cask [options]], run from the repository root.
+
+BIN=${1:-bin/cask}
+[ $# -gt 0 ] && shift
+PORT=${PORT:-3979}
+DIR=$(mktemp -d)
+URL=http://127.0.0.1:$PORT
+PID=
+FAILED=0
+
+cleanup() {
+    [ -n "$PID" ] && kill -9 "$PID" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+# Writing to a connection the server closed too early must fail the test, not
+# kill it
+trap '' PIPE
+
+start() {
+    rm -f "$DIR/test.sock"
+    "$BIN" -p "$PORT" -w 1 -d "$DIR/test.db" -s "$DIR/test.sock" "$@" 2>>"$DIR/log" &
+    PID=$!
+    for _ in $(seq 50); do
+        curl -s -o /dev/null "$URL/" && return
+        sleep 0.1
+    done
+    echo "timeout: cask didn't start"
+    cat "$DIR/log"
+    exit 1
+}
+
+stop() {
+    kill -INT "$PID"
+    wait "$PID" 2>/dev/null
+    PID=
+}
+
+# Sends a keep-alive request on the connection
+touch_connection() {
+    printf 'GET / HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n' >&"$1" 2>/dev/null
+}
+
+# Reads what the server sent on the connection until it has been quiet for a
+# second. Fails if the server closed it.
+is_open() {
+    while :; do
+        read -r -t 1 -u "$1" _
+        rc=$?
+        [ "$rc" -gt 128 ] && return 0
+        [ "$rc" -ne 0 ] && return 1
+    done
+}
+
+expect_open() {
+    if ! is_open "$1"; then
+        echo "timeout: -T $TIMERS: $2 was closed"
+        FAILED=1
+    fi
+}
+
+expect_closed() {
+    if is_open "$1"; then
+        echo "timeout: -T $TIMERS: $2 is still open"
+        FAILED=1
+    fi
+}
+
+for TIMERS in tree wheel; do
+    start -T "$TIMERS" "$@"
+    exec 3<>"/dev/tcp/127.0.0.1/$PORT" 4<>"/dev/tcp/127.0.0.1/$PORT"
+
+    # One connection stays idle, the other is used just before its deadline,
+    # which pushes it back by 5 s
+    sleep 4
+    touch_connection 4
+    expect_open 4 "connection used at 4 s"
+    sleep 1.5
+    expect_closed 3 "idle connection at 6.5 s"
+    expect_open 4 "connection used at 4 s, at 6.5 s"
+    sleep 2.5
+    expect_closed 4 "connection used at 4 s, at 10 s"
+
+    exec 3>&- 4>&-
+    stop
+done
+
+if [ "$FAILED" = 0 ]; then
+    echo "timeout: ok"
+fi
+exit "$FAILED"